@@ -0,0 +1,43 @@
+#include <iostream>
+
+#include "util/ThreadPool.h"
+
+#include "future/Future.h"
+#include "future/Coroutine.h"
+
+Quokka::CoTask<int> loadValue(Quokka::ThreadPool& pool, int v) {
+	// Continues on the worker which ran the task
+	int doubled = co_await pool.execute([v]() {
+		return v * 2;
+	});
+
+	co_return doubled;
+}
+
+Quokka::CoTask<void> sum(Quokka::ThreadPool& pool) {
+	co_await Quokka::scheduleOn(&pool);
+
+	int a = co_await loadValue(pool, 10);
+	int b = co_await Quokka::resumeOn(pool.execute([]() { return 1; }), &pool);
+	std::cout << "1. Got " << a << " and " << b << std::endl;
+
+	int c = co_await Quokka::makeReadyFuture(3);
+	std::cout << "2. Ready future " << c << " without suspending" << std::endl;
+
+	try {
+		co_await pool.execute([]() -> int {
+			throw std::runtime_error("boom");
+		});
+	}
+	catch (const std::exception& e) {
+		std::cout << "3. Caught " << e.what() << std::endl;
+	}
+}
+
+int main() {
+	Quokka::ThreadPool threadPool;
+
+	sum(threadPool).future().then([]() {
+		std::cout << "Finished" << std::endl;
+	}).wait();
+}
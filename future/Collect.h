@@ -0,0 +1,309 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <iterator>
+#include <memory>
+#include <stdexcept>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "Future.h"
+
+namespace Quokka {
+
+/*
+* Fan in of many futures into one
+*
+* Every combinator keeps one shared context: the slots for the results,
+* an atomic countdown and the promise of the combined future. Each input
+* future gets a callback writing its own slot, so they never contend on
+* a lock, and the callback bringing the count to zero sets the promise.
+* The callbacks are hooked right on the input futures, there is no extra
+* then() step, and so no extra promise, per input.
+*
+* The input futures are consumed, like by then(). An input which has
+* timed out counts as failed with TimeoutError.
+*/
+class Collector {
+public:
+
+	template<typename InputIterator>
+	using FutureOf = typename std::iterator_traits<InputIterator>::value_type;
+
+	template<typename InputIterator>
+	using TryOf = typename TryWrapper<typename IsFuture<FutureOf<InputIterator>>::Inner>::Type;
+
+	template<typename InputIterator>
+	static Future<std::vector<TryOf<InputIterator>>> all(InputIterator first, InputIterator last) {
+		using ValueType = TryOf<InputIterator>;
+
+		struct Context {
+			explicit Context(std::size_t n) :
+				results(n),
+				remaining(n) {
+			}
+
+			std::vector<ValueType> results;
+			std::atomic<std::size_t> remaining;
+			Promise<std::vector<ValueType>> pm;
+		};
+
+		const std::size_t n = std::distance(first, last);
+		if (n == 0) {
+			return makeReadyFuture(std::vector<ValueType>());
+		}
+
+		auto ctx = std::make_shared<Context>(n);
+		auto future = ctx->pm.getFuture();
+
+		for (std::size_t i = 0; first != last; ++first, ++i) {
+			first->_onResult([ctx, i](ValueType&& t) {
+				ctx->results[i] = std::move(t);
+				if (ctx->remaining.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+					ctx->pm.setValue(std::move(ctx->results));
+				}
+			});
+		}
+
+		return future;
+	}
+
+	template<typename... Ts>
+	static Future<std::tuple<typename TryWrapper<Ts>::Type...>> allOf(Future<Ts>&... futures) {
+		using ResultType = std::tuple<typename TryWrapper<Ts>::Type...>;
+
+		struct Context {
+			Context() :
+				remaining(sizeof...(Ts)) {
+			}
+
+			ResultType results;
+			std::atomic<std::size_t> remaining;
+			Promise<ResultType> pm;
+		};
+
+		auto ctx = std::make_shared<Context>();
+		auto future = ctx->pm.getFuture();
+		_allOf(ctx, std::index_sequence_for<Ts...>(), futures...);
+
+		return future;
+	}
+
+	// The first one done wins, the value comes with its index
+	template<typename InputIterator>
+	static Future<std::pair<std::size_t, TryOf<InputIterator>>> any(InputIterator first, InputIterator last) {
+		using ValueType = TryOf<InputIterator>;
+		using ResultType = std::pair<std::size_t, ValueType>;
+
+		struct Context {
+			Context() :
+				done(false) {
+			}
+
+			std::atomic<bool> done;
+			Promise<ResultType> pm;
+		};
+
+		if (first == last) {
+			return makeExceptionFuture<ResultType>(std::runtime_error("collectAny on no future"));
+		}
+
+		auto ctx = std::make_shared<Context>();
+		auto future = ctx->pm.getFuture();
+
+		for (std::size_t i = 0; first != last; ++first, ++i) {
+			first->_onResult([ctx, i](ValueType&& t) {
+				if (!ctx->done.exchange(true, std::memory_order_acq_rel)) {
+					ctx->pm.setValue(ResultType(i, std::move(t)));
+				}
+			});
+		}
+
+		return future;
+	}
+
+	// The first n done, in the order they finished, each with its index
+	template<typename InputIterator>
+	static Future<std::vector<std::pair<std::size_t, TryOf<InputIterator>>>>
+	firstN(InputIterator first, InputIterator last, std::size_t n) {
+		using ValueType = TryOf<InputIterator>;
+		using ResultType = std::vector<std::pair<std::size_t, ValueType>>;
+
+		struct Context {
+			explicit Context(std::size_t n) :
+				wanted(n),
+				results(n),
+				claimed(0),
+				filled(0) {
+			}
+
+			// Not results.size(), results is moved out while late inputs still come
+			const std::size_t wanted;
+			ResultType results;
+			// A slot is claimed first, then filled, the nth fill sets the promise
+			std::atomic<std::size_t> claimed;
+			std::atomic<std::size_t> filled;
+			Promise<ResultType> pm;
+		};
+
+		n = std::min<std::size_t>(n, std::distance(first, last));
+		if (n == 0) {
+			return makeReadyFuture(ResultType());
+		}
+
+		auto ctx = std::make_shared<Context>(n);
+		auto future = ctx->pm.getFuture();
+
+		for (std::size_t i = 0; first != last; ++first, ++i) {
+			first->_onResult([ctx, i](ValueType&& t) {
+				const std::size_t slot = ctx->claimed.fetch_add(1, std::memory_order_relaxed);
+				if (slot >= ctx->wanted) {
+					return;
+				}
+
+				ctx->results[slot] = std::make_pair(i, std::move(t));
+				if (ctx->filled.fetch_add(1, std::memory_order_acq_rel) + 1 == ctx->wanted) {
+					ctx->pm.setValue(std::move(ctx->results));
+				}
+			});
+		}
+
+		return future;
+	}
+
+	/*
+	f(input) for each input of the range, with at most maxInFlight of the
+	returned futures pending at a time. The next input starts when one is done.
+	The results are in the order of the inputs
+	*/
+	template<typename InputIterator, typename F>
+	static auto withConcurrency(InputIterator first, InputIterator last, std::size_t maxInFlight, F&& f)
+		-> Future<std::vector<typename TryWrapper<typename IsFuture<
+			typename std::result_of<F&(typename std::iterator_traits<InputIterator>::value_type&)>::type>::Inner>::Type>> {
+		using InputType = typename std::iterator_traits<InputIterator>::value_type;
+		using FutureType = typename std::result_of<F&(InputType&)>::type;
+		using ValueType = typename TryWrapper<typename IsFuture<FutureType>::Inner>::Type;
+
+		static_assert(IsFuture<FutureType>::value, "f must return a Future");
+
+		struct Context {
+			Context(InputIterator first, InputIterator last, F&& f) :
+				inputs(first, last),
+				func(std::forward<F>(f)),
+				results(inputs.size()),
+				next(0),
+				freeSlots(0),
+				remaining(inputs.size()) {
+			}
+
+			std::vector<InputType> inputs;
+			typename std::decay<F>::type func;
+			std::vector<ValueType> results;
+			// Only touched by whoever is starting inputs, see _startNext
+			std::size_t next;
+			std::atomic<std::size_t> freeSlots;
+			std::atomic<std::size_t> remaining;
+			Promise<std::vector<ValueType>> pm;
+		};
+
+		auto ctx = std::make_shared<Context>(first, last, std::forward<F>(f));
+		if (ctx->inputs.empty()) {
+			return makeReadyFuture(std::vector<ValueType>());
+		}
+
+		auto future = ctx->pm.getFuture();
+
+		const std::size_t window = std::min(std::max<std::size_t>(maxInFlight, 1), ctx->inputs.size());
+		for (std::size_t i = 0; i < window; ++i) {
+			_startNext<ValueType, FutureType>(ctx);
+		}
+
+		return future;
+	}
+
+private:
+
+	template<typename Context, typename... Ts, std::size_t... I>
+	static void _allOf(const std::shared_ptr<Context>& ctx, std::index_sequence<I...>, Future<Ts>&... futures) {
+		int expand[] = {0, (futures._onResult([ctx](typename TryWrapper<Ts>::Type&& t) {
+			std::get<I>(ctx->results) = std::move(t);
+			if (ctx->remaining.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+				ctx->pm.setValue(std::move(ctx->results));
+			}
+		}), 0)...};
+		(void)expand;
+	}
+
+	/*
+	A slot of the window is free, start the next input in it
+	Only the caller finding no one else starting inputs does it, in a loop,
+	others just leave their slot to it. So an input finishing at once does
+	not recurse into starting the next one, and next needs no atomic
+	*/
+	template<typename ValueType, typename FutureType, typename Context>
+	static void _startNext(const std::shared_ptr<Context>& ctx) {
+		if (ctx->freeSlots.fetch_add(1, std::memory_order_acq_rel) != 0) {
+			return;
+		}
+
+		do {
+			const std::size_t i = ctx->next++;
+			if (i >= ctx->inputs.size()) {
+				continue;
+			}
+
+			FutureType future;
+			try {
+				future = ctx->func(ctx->inputs[i]);
+			}
+			catch (...) {
+				future = FutureType(ValueType(std::current_exception()));
+			}
+
+			future._onResult([ctx, i](ValueType&& t) {
+				ctx->results[i] = std::move(t);
+				if (ctx->remaining.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+					ctx->pm.setValue(std::move(ctx->results));
+					return;
+				}
+
+				_startNext<ValueType, FutureType>(ctx);
+			});
+		} while (ctx->freeSlots.fetch_sub(1, std::memory_order_acq_rel) != 1);
+	}
+};
+
+template<typename InputIterator,
+	typename = typename std::enable_if<!IsFuture<InputIterator>::value>::type>
+inline auto collectAll(InputIterator first, InputIterator last)
+	-> decltype(Collector::all(first, last)) {
+	return Collector::all(first, last);
+}
+
+template<typename... Ts>
+inline Future<std::tuple<typename TryWrapper<Ts>::Type...>> collectAll(Future<Ts>&&... futures) {
+	return Collector::allOf(futures...);
+}
+
+template<typename InputIterator>
+inline auto collectAny(InputIterator first, InputIterator last)
+	-> decltype(Collector::any(first, last)) {
+	return Collector::any(first, last);
+}
+
+template<typename InputIterator>
+inline auto collectN(InputIterator first, InputIterator last, std::size_t n)
+	-> decltype(Collector::firstN(first, last, n)) {
+	return Collector::firstN(first, last, n);
+}
+
+template<typename InputIterator, typename F>
+inline auto collectWithConcurrency(InputIterator first, InputIterator last, std::size_t maxInFlight, F&& f)
+	-> decltype(Collector::withConcurrency(first, last, maxInFlight, std::forward<F>(f))) {
+	return Collector::withConcurrency(first, last, maxInFlight, std::forward<F>(f));
+}
+
+}  // namespace Quokka
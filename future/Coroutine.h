@@ -0,0 +1,228 @@
+#pragma once
+
+/*
+* C++20 coroutines on top of Future
+*
+* Built only with -std=c++20, see QUOKKA_COROUTINES in CMakeLists.txt,
+* the rest of Quokka stays C++14 and does not include this file.
+*
+* CoTask<int> fetch(ThreadPool& pool) {
+*	int a = co_await pool.execute(loadA);
+*	int b = co_await resumeOn(pool.execute(loadB), &pool);
+*	co_return a + b;
+* }
+*
+* A co_await hooks the coroutine frame right on the awaited future's state,
+* there is no then() step, no new Promise and no type erased lambda per
+* await. A whole flow costs its one frame plus the state of its result.
+*/
+#if defined(__cpp_impl_coroutine) || defined(__cpp_coroutines)
+
+#include <atomic>
+#include <coroutine>
+#include <exception>
+#include <stdexcept>
+#include <utility>
+
+#include "Future.h"
+
+namespace Quokka {
+
+/*
+Suspends the awaiting coroutine until future has its value
+It's resumed by the thread setting the value, or on sched if one is given.
+The value of a ready future is taken at once without suspending
+*/
+template<typename T>
+class FutureAwaiter {
+public:
+
+	using ValueType = typename TryWrapper<T>::Type;
+
+	FutureAwaiter(Future<T>&& future, Scheduler* sched) :
+		future_(std::move(future)),
+		sched_(sched),
+		arrived_(false) {
+	}
+
+	bool await_ready() {
+		if (future_.local_ != Progress::None) {
+			result_ = future_._takeLocal();
+			return true;
+		}
+
+		return future_.state_->takeResult(result_);
+	}
+
+	bool await_suspend(std::coroutine_handle<> handle) {
+		handle_ = handle;
+
+		const bool alive = future_._setCallback([this](ValueType&& t) {
+			result_ = std::move(t);
+			// Second to arrive, the coroutine is suspended for sure
+			if (arrived_.exchange(true, std::memory_order_acq_rel)) {
+				_resume();
+			}
+		});
+
+		if (!alive) {
+			result_ = ValueType(std::make_exception_ptr(std::runtime_error("Future timeout")));
+			return false;
+		}
+
+		// The value came while we got here, go on without suspending
+		return !arrived_.exchange(true, std::memory_order_acq_rel);
+	}
+
+	T await_resume() {
+		result_.check();
+		return _take(std::is_void<T>());
+	}
+
+private:
+
+	void _resume() {
+		if (sched_) {
+			sched_->schedule([handle = handle_]() {
+				handle.resume();
+			});
+		}
+		else {
+			handle_.resume();
+		}
+	}
+
+	T _take(std::false_type) {
+		return std::move(result_).value();
+	}
+
+	void _take(std::true_type) {
+	}
+
+	Future<T> future_;
+	Scheduler* sched_;
+	ValueType result_;
+	std::coroutine_handle<> handle_;
+	// The callback and await_suspend race to it, the second one resumes
+	std::atomic<bool> arrived_;
+};
+
+// co_await future resumes on the thread which set the value
+template<typename T>
+inline FutureAwaiter<T> operator co_await(Future<T>&& future) {
+	return FutureAwaiter<T>(std::move(future), nullptr);
+}
+
+// co_await resumeOn(future, sched) resumes on sched
+template<typename T>
+inline FutureAwaiter<T> resumeOn(Future<T>&& future, Scheduler* sched) {
+	return FutureAwaiter<T>(std::move(future), sched);
+}
+
+// co_await scheduleOn(sched) moves the rest of the coroutine to sched
+class ScheduleAwaiter {
+public:
+
+	explicit ScheduleAwaiter(Scheduler* sched) :
+		sched_(sched) {
+	}
+
+	bool await_ready() const {
+		return false;
+	}
+
+	void await_suspend(std::coroutine_handle<> handle) {
+		sched_->schedule([handle]() {
+			handle.resume();
+		});
+	}
+
+	void await_resume() const {
+	}
+
+private:
+
+	Scheduler* sched_;
+};
+
+inline ScheduleAwaiter scheduleOn(Scheduler* sched) {
+	return ScheduleAwaiter(sched);
+}
+
+template<typename T>
+class CoTask;
+
+template<typename T>
+struct CoPromiseBase {
+	Promise<T> pm_;
+
+	template<typename U>
+	void return_value(U&& value) {
+		pm_.setValue(T(std::forward<U>(value)));
+	}
+};
+
+template<>
+struct CoPromiseBase<void> {
+	Promise<void> pm_;
+
+	void return_void() {
+		pm_.setValue();
+	}
+};
+
+/*
+* The return type of a coroutine producing a T
+*
+* It starts at once on the calling thread and runs until its first
+* suspending co_await. Its result is a Future, so it can be awaited by
+* another coroutine, waited or chained with then() like any other:
+*
+* fetch(pool).future().then([](int sum) { ... });
+*/
+template<typename T>
+class CoTask {
+public:
+
+	struct promise_type : CoPromiseBase<T> {
+		CoTask get_return_object() {
+			return CoTask(this->pm_.getFuture());
+		}
+
+		std::suspend_never initial_suspend() noexcept {
+			return {};
+		}
+
+		// The frame is freed right away, the result lives in the Future
+		std::suspend_never final_suspend() noexcept {
+			return {};
+		}
+
+		void unhandled_exception() {
+			this->pm_.setException(std::current_exception());
+		}
+	};
+
+	CoTask(CoTask&&) = default;
+	CoTask& operator=(CoTask&&) = default;
+
+	Future<T> future() && {
+		return std::move(future_);
+	}
+
+	FutureAwaiter<T> operator co_await() && {
+		return FutureAwaiter<T>(std::move(future_), nullptr);
+	}
+
+private:
+
+	explicit CoTask(Future<T>&& future) :
+		future_(std::move(future)) {
+	}
+
+	Future<T> future_;
+};
+
+}  // namespace Quokka
+
+#endif
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <cstddef>
+#include <new>
+
+namespace Quokka {
+
+/*
+* Per thread cache of freed blocks of one size
+*
+* Short lived objects created at a high rate, like the shared state of a
+* promise and future, come back here instead of going to the allocator,
+* so the next one created on this thread reuses it without a lock.
+* A block freed on another thread than the one which allocated it just goes
+* into that thread's cache.
+* At most kMaxCached blocks are kept per thread, the cache is released
+* when the thread exits.
+*/
+template<std::size_t Size>
+class FreeList {
+public:
+
+	static void* allocate() {
+		Cache& cache = cache_;
+		if (cache.head != nullptr) {
+			Node* node = cache.head;
+			cache.head = node->next;
+			--cache.count;
+			return node;
+		}
+
+		return ::operator new(kBlockSize);
+	}
+
+	static void deallocate(void* p) {
+		Cache& cache = cache_;
+		// The thread is exiting, its cache is gone already
+		if (cache.closed || cache.count >= kMaxCached) {
+			::operator delete(p);
+			return;
+		}
+
+		Node* node = static_cast<Node*>(p);
+		node->next = cache.head;
+		cache.head = node;
+		++cache.count;
+
+		// First block cached on this thread, free them all when it exits
+		if (!cache.registered) {
+			cache.registered = true;
+			(void)releaser_;
+		}
+	}
+
+	static const std::size_t kMaxCached = 1024;
+
+private:
+
+	struct Node {
+		Node* next;
+	};
+
+	static const std::size_t kBlockSize = Size < sizeof(Node) ? sizeof(Node) : Size;
+
+	// Trivially destructible, still usable while other thread locals are destroyed
+	struct Cache {
+		Node* head;
+		std::size_t count;
+		bool registered;
+		bool closed;
+	};
+
+	struct Releaser {
+		~Releaser() {
+			Cache& cache = cache_;
+			cache.closed = true;
+			while (cache.head != nullptr) {
+				Node* node = cache.head;
+				cache.head = node->next;
+				::operator delete(node);
+			}
+			cache.count = 0;
+		}
+	};
+
+	static thread_local Cache cache_;
+	static thread_local Releaser releaser_;
+};
+
+template<std::size_t Size>
+thread_local typename FreeList<Size>::Cache FreeList<Size>::cache_ = {nullptr, 0, false, false};
+
+template<std::size_t Size>
+thread_local typename FreeList<Size>::Releaser FreeList<Size>::releaser_;
+
+template<std::size_t Size>
+const std::size_t FreeList<Size>::kMaxCached;
+
+}  // namespace Quokka
@@ -0,0 +1,191 @@
+#pragma once
+
+#include <cassert>
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace Quokka {
+
+constexpr std::size_t kFunctionInlineSize = 64;
+
+/*
+* A move only replacement of std::function
+*
+* Callables up to Capacity bytes which can be moved without throwing are
+* stored inline, so small closures never touch the allocator. Bigger ones
+* fall back to the heap.
+* Because it's move only, it can hold lambdas with move only captures,
+* such as a Promise, there is no need to make them copyable.
+*/
+template<typename Signature, std::size_t Capacity = kFunctionInlineSize>
+class Function;
+
+template<typename R, typename... Args, std::size_t Capacity>
+class Function<R(Args...), Capacity> {
+public:
+
+	Function() noexcept :
+		ops_(nullptr) {
+	}
+
+	Function(std::nullptr_t) noexcept :
+		ops_(nullptr) {
+	}
+
+	template<typename F,
+		typename = typename std::enable_if<!std::is_same<typename std::decay<F>::type, Function>::value>::type>
+	Function(F&& f) :
+		ops_(nullptr) {
+		using FuncType = typename std::decay<F>::type;
+		using Storage = typename std::conditional<IsInline<FuncType>::value,
+			InlineOps<FuncType>,
+			HeapOps<FuncType>>::type;
+
+		Storage::create(&storage_, std::forward<F>(f));
+		ops_ = &Storage::kOps;
+	}
+
+	// Move only
+	Function(Function&& rhs) noexcept :
+		ops_(rhs.ops_) {
+		if (ops_) {
+			ops_->move(&storage_, &rhs.storage_);
+			rhs.ops_ = nullptr;
+		}
+	}
+
+	Function& operator=(Function&& rhs) noexcept {
+		if (this != &rhs) {
+			reset();
+
+			ops_ = rhs.ops_;
+			if (ops_) {
+				ops_->move(&storage_, &rhs.storage_);
+				rhs.ops_ = nullptr;
+			}
+		}
+
+		return *this;
+	}
+
+	Function& operator=(std::nullptr_t) noexcept {
+		reset();
+		return *this;
+	}
+
+	Function(const Function&) = delete;
+	Function& operator=(const Function&) = delete;
+
+	~Function() {
+		reset();
+	}
+
+	R operator()(Args... args) {
+		assert(ops_);
+		return ops_->invoke(&storage_, std::forward<Args>(args)...);
+	}
+
+	explicit operator bool() const noexcept {
+		return ops_ != nullptr;
+	}
+
+	void reset() noexcept {
+		if (ops_) {
+			ops_->destroy(&storage_);
+			ops_ = nullptr;
+		}
+	}
+
+private:
+
+	using StorageType = typename std::aligned_storage<Capacity, alignof(std::max_align_t)>::type;
+
+	struct Ops {
+		R (*invoke)(void* storage, Args&&... args);
+		// Move construct into dst and destroy src
+		void (*move)(void* dst, void* src);
+		void (*destroy)(void* storage);
+	};
+
+	template<typename F>
+	struct IsInline {
+		static constexpr bool value =
+			sizeof(F) <= Capacity &&
+			alignof(std::max_align_t) % alignof(F) == 0 &&
+			std::is_nothrow_move_constructible<F>::value;
+	};
+
+	template<typename F>
+	struct InlineOps {
+		template<typename G>
+		static void create(void* storage, G&& g) {
+			new (storage) F(std::forward<G>(g));
+		}
+
+		static R invoke(void* storage, Args&&... args) {
+			return (*static_cast<F*>(storage))(std::forward<Args>(args)...);
+		}
+
+		static void move(void* dst, void* src) {
+			F* from = static_cast<F*>(src);
+			new (dst) F(std::move(*from));
+			from->~F();
+		}
+
+		static void destroy(void* storage) {
+			static_cast<F*>(storage)->~F();
+		}
+
+		static const Ops kOps;
+	};
+
+	template<typename F>
+	struct HeapOps {
+		template<typename G>
+		static void create(void* storage, G&& g) {
+			*static_cast<F**>(storage) = new F(std::forward<G>(g));
+		}
+
+		static R invoke(void* storage, Args&&... args) {
+			return (**static_cast<F**>(storage))(std::forward<Args>(args)...);
+		}
+
+		static void move(void* dst, void* src) {
+			*static_cast<F**>(dst) = *static_cast<F**>(src);
+		}
+
+		static void destroy(void* storage) {
+			delete *static_cast<F**>(storage);
+		}
+
+		static const Ops kOps;
+	};
+
+	StorageType storage_;
+	const Ops* ops_;
+};
+
+template<typename R, typename... Args, std::size_t Capacity>
+template<typename F>
+const typename Function<R(Args...), Capacity>::Ops
+Function<R(Args...), Capacity>::InlineOps<F>::kOps = {
+	&InlineOps<F>::invoke,
+	&InlineOps<F>::move,
+	&InlineOps<F>::destroy
+};
+
+template<typename R, typename... Args, std::size_t Capacity>
+template<typename F>
+const typename Function<R(Args...), Capacity>::Ops
+Function<R(Args...), Capacity>::HeapOps<F>::kOps = {
+	&HeapOps<F>::invoke,
+	&HeapOps<F>::move,
+	&HeapOps<F>::destroy
+};
+
+// The unit of work queued in executors and timers
+using Task = Function<void()>;
+
+}  // namespace Quokka
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <cstdint>
+#include <thread>
+
+#ifdef __linux__
+#include <ctime>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace Quokka {
+
+/*
+* Sleeping on an atomic 32 bit word
+*
+* On linux it's a futex: the kernel checks the word and parks the thread
+* in one step, and there is nothing to allocate or lock. Elsewhere the
+* waiter polls with short sleeps.
+*/
+static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t), "Futex needs a plain 32 bit word");
+
+// Returns when the word is likely not expected anymore, on timeout, or for no reason
+inline void futexWait(std::atomic<uint32_t>* word, uint32_t expected, std::chrono::nanoseconds timeout) {
+	if (timeout.count() <= 0) {
+		return;
+	}
+
+#ifdef __linux__
+	struct timespec ts;
+	ts.tv_sec = static_cast<time_t>(timeout.count() / 1000000000);
+	ts.tv_nsec = static_cast<long>(timeout.count() % 1000000000);
+	syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAIT_PRIVATE, expected, &ts, nullptr, 0);
+#else
+	if (word->load(std::memory_order_acquire) == expected) {
+		std::this_thread::sleep_for(std::min<std::chrono::nanoseconds>(timeout, std::chrono::microseconds(50)));
+	}
+#endif
+}
+
+inline void futexWakeAll(std::atomic<uint32_t>* word) {
+#ifdef __linux__
+	syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAKE_PRIVATE, INT_MAX, nullptr, nullptr, 0);
+#else
+	(void)word;
+#endif
+}
+
+inline void cpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	asm volatile("yield");
+#endif
+}
+
+/*
+Spin a little while the word is expected, before going to sleep on it
+How long depends on how it went lately on this thread: a spin seeing the
+change doubles the next one, a spin in vain halves it
+*/
+inline bool spinWhile(const std::atomic<uint32_t>& word, uint32_t expected) {
+	static const int kMinSpins = 16;
+	static const int kMaxSpins = 4096;
+	static thread_local int spins = 256;
+
+	for (int i = 0; i < spins; ++i) {
+		if (word.load(std::memory_order_acquire) != expected) {
+			spins = std::min(spins * 2, kMaxSpins);
+			return true;
+		}
+
+		cpuRelax();
+	}
+
+	spins = std::max(spins / 2, kMinSpins);
+	return false;
+}
+
+}  // namespace Quokka
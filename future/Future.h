@@ -1,12 +1,19 @@
 ﻿#pragma once
 
 #include <atomic>
+#include <chrono>
+#include <memory>
 #include <functional>
-#include <mutex>
+#include <stdexcept>
 #include <type_traits>
+#include <utility>
 
+#include "FreeList.h"
+#include "Futex.h"
+#include "Function.h"
 #include "Helper.h"
 #include "Scheduler.h"
+#include "TimerWheel.h"
 #include "Try.h"
 
 namespace Quokka {
@@ -18,10 +25,242 @@ enum class Progress {
 	Retrieved
 };
 
-using TimeoutCallback = std::function<void()>;
+// How long Future::wait on a pool worker sleeps before looking for work again
+constexpr std::chrono::microseconds kHelpWaitSlice(500);
+// Default timeout of Future::wait
+constexpr std::chrono::milliseconds kWaitForever(24 * 3600 * 1000);
+
+// What a cancelled step fails with, instead of running
+class CancelledError : public std::runtime_error {
+public:
+	CancelledError() :
+		std::runtime_error("Future cancelled") {
+	}
+};
+
+// What a future from within() or withDeadline() fails with when it's late
+class TimeoutError : public std::runtime_error {
+public:
+	TimeoutError() :
+		std::runtime_error("Future timeout") {
+	}
+};
+
+/*
+* Cancellation token of a then() chain
+*
+* All the states of one chain share it, so Future::cancel on the last
+* future reaches the producers of the first one. Setting it stops nothing
+* by itself: producers look at it before running a step and drop the step,
+* a running step may poll it through CancelScope::requested().
+*/
+class CancelState {
+public:
+
+	CancelState() :
+		refs_(1),
+		cancelled_(false),
+		links_(nullptr) {
+	}
+
+	CancelState(const CancelState&) = delete;
+	CancelState& operator=(const CancelState&) = delete;
+
+	~CancelState() {
+		Link* link = links_.load(std::memory_order_acquire);
+		while (link && link != _closed()) {
+			Link* next = link->next;
+			link->token->release();
+			delete link;
+			link = next;
+		}
+	}
+
+	static void* operator new(std::size_t) {
+		return FreeList<sizeof(CancelState)>::allocate();
+	}
+
+	static void operator delete(void* p) {
+		FreeList<sizeof(CancelState)>::deallocate(p);
+	}
+
+	void addRef() {
+		refs_.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	void release() {
+		if (refs_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+			delete this;
+		}
+	}
+
+	void cancel() {
+		if (cancelled_.exchange(true, std::memory_order_acq_rel)) {
+			return;
+		}
+
+		// Closing the list, links made from now on cancel at once
+		Link* link = links_.exchange(_closed(), std::memory_order_acq_rel);
+		while (link) {
+			Link* next = link->next;
+			link->token->cancel();
+			link->token->release();
+			delete link;
+			link = next;
+		}
+	}
+
+	bool cancelled() const {
+		return cancelled_.load(std::memory_order_acquire);
+	}
+
+	/*
+	Cancelling this token cancels other too
+	For a future returned by a then() callback which has a chain of its own
+	*/
+	void link(CancelState* other) {
+		if (other == this) {
+			return;
+		}
+
+		other->addRef();
+		Link* node = new Link{other, links_.load(std::memory_order_acquire)};
+		while (node->next != _closed()) {
+			if (links_.compare_exchange_weak(node->next, node, std::memory_order_acq_rel, std::memory_order_acquire)) {
+				return;
+			}
+		}
+
+		delete node;
+		other->cancel();
+		other->release();
+	}
+
+private:
+
+	struct Link {
+		CancelState* token;
+		Link* next;
+	};
+
+	static Link* _closed() {
+		static Link closed = {nullptr, nullptr};
+		return &closed;
+	}
+
+	std::atomic<uint32_t> refs_;
+	std::atomic<bool> cancelled_;
+	std::atomic<Link*> links_;
+};
+
+// What the states of all value types share
+struct StateBase {
+	StateBase() :
+		cancel_(nullptr) {
+	}
+
+	StateBase(const StateBase&) = delete;
+	StateBase& operator=(const StateBase&) = delete;
+
+	~StateBase() {
+		if (CancelState* token = cancel_.load(std::memory_order_acquire)) {
+			token->release();
+		}
+	}
+
+	// The token of our chain, made on first use
+	CancelState* cancelState() {
+		CancelState* token = cancel_.load(std::memory_order_acquire);
+		if (token) {
+			return token;
+		}
+
+		CancelState* fresh = new CancelState();
+		if (cancel_.compare_exchange_strong(token, fresh, std::memory_order_acq_rel, std::memory_order_acquire)) {
+			return fresh;
+		}
+
+		fresh->release();
+		return token;
+	}
+
+	// Be cancelled with token: share it, or link ours to it if we have one
+	void followCancel(CancelState* token) {
+		CancelState* own = nullptr;
+		token->addRef();
+		if (cancel_.compare_exchange_strong(own, token, std::memory_order_acq_rel, std::memory_order_acquire)) {
+			return;
+		}
+
+		token->release();
+		token->link(own);
+	}
+
+	bool cancelled() const {
+		CancelState* token = cancel_.load(std::memory_order_acquire);
+		return token && token->cancelled();
+	}
+
+	std::atomic<CancelState*> cancel_;
+};
+
+/*
+* The step running on this thread, for polling its cancellation
+*
+* Promise::setWith sets it around the work it runs, so long work can
+* bail out early:
+*
+* pool.execute([]() {
+*	for (auto& chunk : chunks) {
+*		if (CancelScope::requested()) {
+*			throw CancelledError();
+*		}
+*		...
+*	}
+* });
+*/
+class CancelScope {
+public:
+
+	explicit CancelScope(const StateBase* state) :
+		outer_(_current()) {
+		_current() = state;
+	}
+
+	CancelScope(const CancelScope&) = delete;
+	CancelScope& operator=(const CancelScope&) = delete;
+
+	~CancelScope() {
+		_current() = outer_;
+	}
+
+	// A load and a compare when nothing is cancelled
+	static bool requested() {
+		const StateBase* state = _current();
+		return state && state->cancelled();
+	}
+
+	// A fiber takes its scope along when it moves to another thread
+	static const StateBase* current() {
+		return _current();
+	}
+
+	static void setCurrent(const StateBase* state) {
+		_current() = state;
+	}
+
+private:
+
+	static const StateBase*& _current() {
+		static thread_local const StateBase* s_current = nullptr;
+		return s_current;
+	}
+
+	const StateBase* outer_;
+};
 
 template<typename T>
-struct State {
+struct State : StateBase {
 	/*
 	template<class T, class U>
 	struct is_same;
@@ -38,33 +277,278 @@ struct State {
 		"Must be copyable or movable or void"
 	);
 
+	/*
+	从Try.h文件中的分析可以发现TryWrapper<T>::Type指的是被Try包裹的T，即使T是Try<T>
+	所以ValueType就是被Try包裹的value type
+	*/
+	using ValueType = typename TryWrapper<T>::Type;
+	using Callback = Function<void(ValueType&&)>;
+
+	/*
+	The handoff between producer and consumer, there is no lock:
+
+	Start -> Setting        setResult claims the state, then writes value_
+	Setting -> HasResult    the value waits for a consumer
+	Start -> HasCallback    setCallback, the callback waits for a value
+	HasResult -> Done       the consumer takes the value
+	HasCallback -> Done     the producer calls the callback
+	Start/HasCallback -> Timeout
+
+	The consumer writes then_ first, then publishes it with one
+	compare-exchange, the side losing the race sees what the other published
+	and finishes the job itself. A producer claims the state before it
+	touches value_, one losing the claim to another producer or to a timeout
+	leaves without writing anything. Done and Timeout are final.
+	*/
+	enum Fsm : uint32_t {
+		Start,
+		HasResult,
+		HasCallback,
+		Done,
+		Timeout,
+		Setting
+	};
+
 	State() :
-		progress_(Progress::None),
+		refs_(1),
+		fsm_(Start),
+		waiters_(0),
 		retrieved_(false) {
 	}
 
-	std::mutex thenLock_;
+	State(const State&) = delete;
+	State& operator=(const State&) = delete;
+
+	// Freed states are kept by the thread freeing them for the next promise
+	static void* operator new(std::size_t) {
+		return FreeList<sizeof(State)>::allocate();
+	}
+
+	static void operator delete(void* p) {
+		FreeList<sizeof(State)>::deallocate(p);
+	}
+
+	void addRef() {
+		refs_.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	void release() {
+		if (refs_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+			delete this;
+		}
+	}
+
+	Progress progress() const {
+		switch (fsm_.load(std::memory_order_acquire)) {
+		case HasResult:
+			return Progress::Done;
+
+		case Done:
+			return Progress::Retrieved;
+
+		case Timeout:
+			return Progress::Timeout;
+
+		default:
+			return Progress::None;
+		}
+	}
+
+	// Ignored if the value was already set, is being set or it has timed out
+	template<typename V>
+	void setResult(V&& v) {
+		uint32_t fsm = fsm_.load(std::memory_order_acquire);
+		for (;;) {
+			if (fsm == Start) {
+				if (fsm_.compare_exchange_weak(fsm, Setting, std::memory_order_acq_rel, std::memory_order_acquire)) {
+					value_ = std::forward<V>(v);
+					// Only we move it on from Setting
+					fsm_.store(HasResult, std::memory_order_release);
+					_wake();
+					return;
+				}
+			}
+			else if (fsm == HasCallback) {
+				if (fsm_.compare_exchange_weak(fsm, Done, std::memory_order_acq_rel, std::memory_order_acquire)) {
+					// The callback is waiting, value_ is never written
+					then_(ValueType(std::forward<V>(v)));
+					return;
+				}
+			}
+			else {
+				// Another producer or a timeout came first, nobody wants it
+				return;
+			}
+		}
+	}
 
 	/*
-	从Try.h文件中的分析可以发现TryWrapper<T>::Type指的是被Try包裹的T，即使T是Try<T>
-	所以ValueType就是被Try包裹的value type
+	Call func with the value, right now if it's there, otherwise when it's set
+	Returns false if it has timed out, throws if the value is already taken
 	*/
-	using ValueType = typename TryWrapper<T>::Type;
+	bool setCallback(Callback&& func) {
+		uint32_t fsm = fsm_.load(std::memory_order_acquire);
+		if (fsm == Start) {
+			then_ = std::move(func);
+			if (fsm_.compare_exchange_strong(fsm, HasCallback, std::memory_order_acq_rel, std::memory_order_acquire)) {
+				return true;
+			}
+
+			// The producer or the timer came first, then_ is still ours
+			func = std::move(then_);
+		}
+
+		// A producer is writing value_, it's there in a moment
+		while (fsm == Setting) {
+			cpuRelax();
+			fsm = fsm_.load(std::memory_order_acquire);
+		}
+
+		if (fsm == HasResult &&
+			fsm_.compare_exchange_strong(fsm, Done, std::memory_order_acq_rel, std::memory_order_acquire)) {
+			func(std::move(value_));
+			return true;
+		}
+
+		if (fsm == Timeout) {
+			return false;
+		}
+
+		throw std::runtime_error("Future already retrieved");
+	}
+
+	// Move the value to out if it's there and not taken yet
+	bool takeResult(ValueType& out) {
+		uint32_t fsm = HasResult;
+		if (!fsm_.compare_exchange_strong(fsm, Done, std::memory_order_acq_rel, std::memory_order_acquire)) {
+			return false;
+		}
+
+		out = std::move(value_);
+		return true;
+	}
+
+	// Returns false if a value came first
+	bool setTimeout() {
+		uint32_t fsm = fsm_.load(std::memory_order_acquire);
+		while (fsm == Start || fsm == HasCallback) {
+			if (fsm_.compare_exchange_weak(fsm, Timeout, std::memory_order_acq_rel, std::memory_order_acquire)) {
+				_wake();
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	bool hasCallback() const {
+		return fsm_.load(std::memory_order_acquire) == HasCallback;
+	}
+
+	// Block until the value or a timeout comes, or until deadline
+	void waitUntil(const std::chrono::steady_clock::time_point& deadline) {
+		if (spinWhile(fsm_, Start) && fsm_.load(std::memory_order_acquire) != Setting) {
+			return;
+		}
+
+		waiters_.fetch_add(1, std::memory_order_relaxed);
+		// Pairs with the fence in _wake, either we see the new state or they see us
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		// Setting is left with a wake too, a waiter sleeps through it
+		uint32_t fsm;
+		while ((fsm = fsm_.load(std::memory_order_acquire)) == Start || fsm == Setting) {
+			const auto now = std::chrono::steady_clock::now();
+			if (now >= deadline) {
+				break;
+			}
+
+			futexWait(&fsm_, fsm, deadline - now);
+		}
+		waiters_.fetch_sub(1, std::memory_order_relaxed);
+	}
+
+	void _wake() {
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		// Nobody asleep, that's the common case and it costs no system call
+		if (waiters_.load(std::memory_order_relaxed) != 0) {
+			futexWakeAll(&fsm_);
+		}
+	}
+
+	// Promise, future and pending timeouts each hold a reference
+	std::atomic<uint32_t> refs_;
+	// A 32 bit word, so waiters can sleep on it
+	std::atomic<uint32_t> fsm_;
+	// Threads asleep in waitUntil
+	std::atomic<uint32_t> waiters_;
+	std::atomic<bool> retrieved_;
 	ValueType value_;
 
 	/*
 	ValueType是被Try包裹的type
-	这里的std::function包裹了一个接受ValueType的右值引用并且返回void的函数
+	这里的Function包裹了一个接受ValueType的右值引用并且返回void的函数
+	Function是move only的，小的closure直接存储在内部，不会分配内存
 	*/
-	std::function<void (ValueType&& )> then_;
-	Progress progress_;
+	Callback then_;
+};
 
-	/*
-	TimeoutCallback是std::function<void()>，包裹一个不接受参数返回void的函数
-	这里的std::function包裹了一个接受 不接受参数返回void的函数 为argument并且返回void的函数
-	*/
-	std::function<void(TimeoutCallback&&)> onTimeout_;
-	std::atomic<bool> retrieved_;
+/*
+* Owning pointer to a State, the count lives in the State itself
+*
+* So a promise and its future share one allocation, not a State plus
+* the control block of a shared_ptr.
+*/
+template<typename T>
+class StateRef {
+public:
+
+	StateRef() :
+		state_(nullptr) {
+	}
+
+	// Takes over the reference the State was created with
+	explicit StateRef(State<T>* state) :
+		state_(state) {
+	}
+
+	StateRef(const StateRef& rhs) :
+		state_(rhs.state_) {
+		if (state_) {
+			state_->addRef();
+		}
+	}
+
+	StateRef(StateRef&& rhs) noexcept :
+		state_(rhs.state_) {
+		rhs.state_ = nullptr;
+	}
+
+	StateRef& operator=(StateRef rhs) noexcept {
+		std::swap(state_, rhs.state_);
+		return *this;
+	}
+
+	~StateRef() {
+		if (state_) {
+			state_->release();
+		}
+	}
+
+	State<T>* operator->() const {
+		return state_;
+	}
+
+	State<T>* get() const {
+		return state_;
+	}
+
+	explicit operator bool() const {
+		return state_ != nullptr;
+	}
+
+private:
+
+	State<T>* state_;
 };
 
 template<typename T>
@@ -73,47 +557,26 @@ public:
 
 	/*
 	使用默认的构造函数去构造state
-	在这种情况下，state的progress_会被设置成None
+	在这种情况下，state的progress()为None
 	它的retrieved_会被设置成false
 	*/
 	Promise() :
-		state_(std::make_shared<State<T>>()) {
+		state_(new State<T>()) {
 	}
 
-	// The lambda with movable capture can not be stored in
-	// std::function, just for compile, do NOT copy promise!
-	Promise(const Promise& rhs) = default;
-	Promise& operator=(const Promise& rhs) = default;
+	// Move only, callbacks capturing a promise are stored in Function
+	Promise(const Promise& rhs) = delete;
+	Promise& operator=(const Promise& rhs) = delete;
 
 	Promise(Promise&& promise) = default;
 	Promise& operator=(Promise&& promise) = default;
 
 	void setException(std::exception_ptr exp) {
 		/*
-		首先用Promise的state_中的thenLock_去lock
-		接下来如果当前的Promise的state_中的progress_不为None的时候，表明state_的value_
-		已经被设置过了，这种情况下直接返回
-		*/
-		std::unique_lock<std::mutex> guard(state_->thenLock_);
-		if (state_->progress_ != Progress::None) {
-			return;
-		}
-
-		/*
-		将进行状态设置为Done
-		将value_设置为异常的指针类型
+		如果state_的value_已经被设置过了，或者已经超时了，这个exception会被忽略
+		否则将value_设置为异常的指针类型，如果then_已经被设置，会以value_为参数调用then_
 		*/
-		state_->progress_ = Progress::Done;
-		state_->value_ = typename State<T>::ValueType(std::move(exp));
-		guard.unlock();
-
-		/*
-		如果state_的then_没有被设置，那么if它就是false，如果已经被设置这里的if就是true
-		进到if statement之后，会以state_的value_为参数调用then_函数
-		*/
-		if (state_->then_) {
-			state_->then_(std::move(state_->value_));
-		}
+		state_->setResult(typename State<T>::ValueType(std::move(exp)));
 	}
 
 	/*
@@ -129,137 +592,47 @@ public:
 	// 为false，enable_if就会不存在type
 	typename std::enable_if<!std::is_void<SHIT>::value, void>::type
 	setValue(SHIT&& t) {
-		// If ThenImp is running, here will wait for the lock.
-		// After set then_, ThenImp will release lock.
-		// And this func got lock, definitely will can then_
-		// std::unique_lock与std::lock_guard的区别在于对于std::unique_lock可以进行unlock
-		std::unique_lock<std::mutex> guard(state_->thenLock_);
-		if (state_->progress_ != Progress::None) {
-			return;
-		}
-
-		state_->progress_ = Progress::Done;
-		state_->value_ = std::forward<SHIT>(t);
-
-		guard.unlock();
-
-		// When reach here, state_ is determined, so mutex is useless
-		// If the ThenImp function run, it'll see the Done state and
-		// call user func there, not assign to then_.
-		if (state_->then_) {
-			state_->then_(std::move(state_->value_));
-		}
+		// If a callback is registered, it's called here, on this thread.
+		// Otherwise the value waits in state_, and the one registering
+		// a callback later calls it on its own thread.
+		state_->setResult(std::forward<SHIT>(t));
 	}
 
 	template<typename SHIT = T>
 	typename std::enable_if<!std::is_void<SHIT>::value, void>::type
 	setValue(const SHIT& t) {
-		/*
-		首先使用mutex将其lock起来
-		接着如果当前Promise的state_中的progress_不为None，表明当前的Promise已经被set过，
-		这时候返回即可
-		*/
-		std::unique_lock<std::mutex> guard(state_->thenLock_);
-		if (state_->progress_ != Progress::None) {
-			return;
-		}
-
-		/*
-		将progress_的状态设置为Done
-		设置state_的value_为传进来的参数t
-		*/
-		state_->progress_ = Progress::Done;
-		state_->value_ = t;
-
-		guard.unlock();
-		if (state_->then_) {
-			state_->then_(std::move(state_->value_));
-		}
+		state_->setResult(t);
 	}
 
 	template<typename SHIT = T>
 	typename std::enable_if<!std::is_void<SHIT>::value, void>::type
 	setValue(Try<SHIT>&& t) {
-		std::unique_lock<std::mutex> guard(state_->thenLock_);
-		if (state_->progress_ != Progress::None) {
-			return;
-		}
-
-		state_->progress_ = Progress::Done;
-		state_->value_ = std::forward<Try<SHIT>>(t);
-
-		guard.unlock();
-		if (state_->then_) {
-			state_->then_(std::move(state_->value_));
-		}
+		state_->setResult(std::move(t));
 	}
 
 	template<typename SHIT = T>
 	typename std::enable_if<!std::is_void<SHIT>::value, void>::type
 	setValue(const Try<SHIT>& t) {
-		std::unique_lock<std::mutex> guard(state_->thenLock_);
-		if (state_->progress != Progress::None) {
-			return;
-		}
-
-		state_->progress = Progress::Done;
-		state_->value_ = t;
-
-		guard.unlock();
-		if (state_->then_) {
-			state_->then_(std::move(state_->value_));
-		}
+		state_->setResult(t);
 	}
 
 	template<typename SHIT = T>
 	typename std::enable_if<std::is_void<SHIT>::value, void>::type
 	setValue(Try<void>&& t) {
-		std::unique_lock<std::mutex> guard(state_->thenLock_);
-		if (state_->progress_ != Progress::None) {
-			return;
-		}
-
-		state_->progress_ = Progress::Done;
-		state_->value_ = Try<void>();
-
-		guard.unlock();
-		if (state_->then_) {
-			state_->then_(std::move(state_->value_));
-		}
+		// Keep the exception, if t holds one
+		state_->setResult(std::move(t));
 	}
 
 	template<typename SHIT = T>
 	typename std::enable_if<std::is_void<SHIT>::value, void>::type
 	setValue(const Try<void>& t) {
-		std::unique_lock<std::mutex> guard(state_->thenLock_);
-		if (state_->progress_ != Progress::None) {
-			return;
-		}
-
-		state_->progress_ = Progress::Done;
-		state_->value_ = Try<void>();
-
-		guard.unlock();
-		if (state_->then_) {
-			state_->then_(std::move(state_->value_));
-		}
+		state_->setResult(t);
 	}
 
 	template<typename SHIT = T>
 	typename std::enable_if<std::is_void<SHIT>::value, void>::type
 	setValue() {
-		std::unique_lock<std::mutex> guard(state_->thenLock_);
-		if (state_->progress_ != Progress::None) {
-			return;
-		}
-
-		state_->progress_ = Progress::Done;
-		state_->value_ = Try<void>();
-
-		guard.unlock();
-		if (state_->then_) {
-			state_->then_(std::move(state_->value_));
-		}
+		state_->setResult(Try<void>());
 	}
 
 	Future<T> getFuture() {
@@ -280,95 +653,265 @@ public:
 	}
 
 	bool isReady() const {
-		return state_->progress_ != Progress::None;
+		return state_->progress() != Progress::None;
+	}
+
+	// The future, or one chained after it, was cancelled
+	bool isCancelled() const {
+		return state_->cancelled();
+	}
+
+	/*
+	Set the value func(args...) returns, or the exception it throws
+	func is not called on a cancelled promise, which fails with CancelledError
+	instead. While it runs CancelScope::requested() tells about our cancellation
+	*/
+	template<typename F, typename... Args>
+	void setWith(F&& func, Args&&... args) {
+		if (isCancelled()) {
+			setException(std::make_exception_ptr(CancelledError()));
+			return;
+		}
+
+		state_->setResult(_call(std::forward<F>(func), std::forward<Args>(args)...));
 	}
 
 private:
 
+	// Future<U>::then joins the promise of the next step to its chain
+	template<typename U>
+	friend class Future;
+
+	// The scope only covers func, not the callbacks setting the value runs
+	template<typename F, typename... Args>
+	typename State<T>::ValueType _call(F&& func, Args&&... args) {
+		CancelScope scope(state_.get());
+		try {
+			return WrapWithTry(std::forward<F>(func), std::forward<Args>(args)...);
+		}
+		catch (...) {
+			// WrapWithTry only catches what derives from std::exception
+			return typename State<T>::ValueType(std::current_exception());
+		}
+	}
+
 	/*
 	首先Promise是一个模板类，需要用某个type进行特化
 	Promise含有一个指向State的指针，这个State同样是一个模板，会使用与特化Promise同样的参数类型进行特化
 	
 	State含有一些比较重要的变量
-	progress_为当前进行的进度：None, Timeout, Done或者Retrieved
+	fsm_为生产者和消费者交接的状态，由它得到progress(): None, Timeout, Done或者Retrieved
 	value_为一个值，是用Try struct进行包裹的
-	then_是一个std::function
-	retrieved_表示这个State中的值有没有被取走
-	thenLock_是一个mutex
+	then_是一个Function
+	retrieved_表示这个State的future有没有被取走
 	*/
-	std::shared_ptr<State<T>> state_;
+	StateRef<T> state_;
+};
+
+/*
+* The deadline of Future::withDeadline, on the TimerWheel
+*
+* Whichever of the value and the wheel comes first sets the promise. Both
+* hold a reference, the value takes the entry off the wheel when it's
+* first, so an entry lives no longer than the wait for its value.
+* A value which never comes, its promise dropped, just drops its reference.
+*/
+template<typename T>
+class DeadlineEntry final : public TimerWheel::Entry {
+public:
+
+	DeadlineEntry(Promise<T>&& pm, CancelState* token) :
+		refs_(2),
+		done_(false),
+		pm_(std::move(pm)),
+		token_(token) {
+		token_->addRef();
+	}
+
+	static void* operator new(std::size_t) {
+		return FreeList<sizeof(DeadlineEntry)>::allocate();
+	}
+
+	static void operator delete(void* p) {
+		FreeList<sizeof(DeadlineEntry)>::deallocate(p);
+	}
+
+	// The callback on the future with the value, holding its reference
+	class ValueRef {
+	public:
+
+		explicit ValueRef(DeadlineEntry* entry) :
+			entry_(entry) {
+		}
+
+		ValueRef(ValueRef&& rhs) noexcept :
+			entry_(rhs.entry_) {
+			rhs.entry_ = nullptr;
+		}
+
+		~ValueRef() {
+			if (entry_) {
+				entry_->_release();
+			}
+		}
+
+		void operator()(typename TryWrapper<T>::Type&& t) {
+			DeadlineEntry* entry = entry_;
+			entry_ = nullptr;
+			entry->_onValue(std::move(t));
+		}
+
+	private:
+
+		DeadlineEntry* entry_;
+	};
+
+	void onExpire() override {
+		if (!done_.exchange(true, std::memory_order_acq_rel)) {
+			pm_.setException(std::make_exception_ptr(TimeoutError()));
+			// Nobody gets the value anymore, stop the steps producing it
+			token_->cancel();
+		}
+		_release();
+	}
+
+private:
+
+	~DeadlineEntry() {
+		token_->release();
+	}
+
+	void _onValue(typename TryWrapper<T>::Type&& t) {
+		if (TimerWheel::instance().remove(this)) {
+			// The wheel won't call us, its reference is ours to drop
+			_release();
+		}
+
+		if (!done_.exchange(true, std::memory_order_acq_rel)) {
+			pm_.setValue(std::move(t));
+		}
+		_release();
+	}
+
+	void _release() {
+		if (refs_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+			delete this;
+		}
+	}
+
+	std::atomic<uint32_t> refs_;
+	std::atomic<bool> done_;
+	Promise<T> pm_;
+	CancelState* token_;
 };
 
 template<typename T2>
 Future<T2> makeExceptionFuture(std::exception_ptr&&);
 
+class Collector;
+class Retrier;
+
 template<typename T>
 class Future {
 public:
 
-	Future() = default;
+	Future() :
+		local_(Progress::None) {
+	}
 
 	Future(const Future& rhs) = delete;
 	Future& operator=(const Future& rhs) = delete;
 
-	Future(Future&& future) = default;
-	Future& operator=(Future&& future) = default;
+	Future(Future&& future) :
+		state_(std::move(future.state_)),
+		local_(future.local_),
+		value_(std::move(future.value_)) {
+		future.local_ = Progress::None;
+	}
+
+	Future& operator=(Future&& future) {
+		if (this != &future) {
+			state_ = std::move(future.state_);
+			local_ = future.local_;
+			value_ = std::move(future.value_);
+			future.local_ = Progress::None;
+		}
 
-	explicit Future(std::shared_ptr<State<T>> state) :
-		state_(std::move(state)) {
+		return *this;
+	}
+
+	explicit Future(StateRef<T> state) :
+		state_(std::move(state)),
+		local_(Progress::None) {
+	}
+
+	/*
+	A future which already has its value, like a cache hit
+	The value is kept right here, there is no State and no Promise, then()
+	runs its callback at once on this thread
+	*/
+	explicit Future(typename TryWrapper<T>::Type&& value) :
+		local_(Progress::Done),
+		value_(std::move(value)) {
 	}
 
 	bool valid() const {
-		return state_ != nullptr;
+		return local_ != Progress::None || static_cast<bool>(state_);
 	}
 
 	typename State<T>::ValueType
-	wait(const std::chrono::milliseconds& timeout = std::chrono::milliseconds(24 * 3600 * 1000)) {
-		std::unique_lock<std::mutex> guard(state_->thenLock_);
-		switch (state_->progress_) {
-		case Progress::None:
-			break;
+	wait(const std::chrono::milliseconds& timeout = kWaitForever) {
+		if (local_ != Progress::None) {
+			return _takeLocal();
+		}
 
-		case Progress::Timeout:
-			throw std::runtime_error("Future timeout");
+		Scheduler* helper = Scheduler::current();
+		Suspender* fiber = Suspender::current();
+		const auto deadline = std::chrono::steady_clock::now() + timeout;
+		for (;;) {
+			typename State<T>::ValueType value;
+			if (state_->takeResult(value)) {
+				return value;
+			}
 
-		case Progress::Done:
-			state_->progress_ = Progress::Retrieved;
-			return std::move(state_->value_);
+			switch (state_->progress()) {
+			case Progress::None:
+				break;
 
-		default:
-			throw std::runtime_error("Future already retrieved");
-		}
-		guard.unlock();
-
-		auto cond(std::make_shared<std::condition_variable>());
-		auto mutex(std::make_shared<std::mutex>());
-		bool ready = false;
-		typename State<T>::ValueType value;
-
-		this->then([
-			&value,
-			&ready,
-			wcond = std::weak_ptr<std::condition_variable>(cond),
-			wmutex = std::weak_ptr<std::mutex>(mutex)
-		](typename State<T>::ValueType&& v) {
-			auto cond = wcond.lock();
-			auto mutex = wmutex.lock();
-			if (!cond || !mutex) return;
-
-			std::unique_lock<std::mutex> guard(*mutex);
-			value = std::move(v);
-			ready = true;
-			cond->notify_one();
-		});
+			case Progress::Timeout:
+				throw std::runtime_error("Future timeout");
 
-		std::unique_lock<std::mutex> waiter(*mutex);
-		bool success = cond->wait_for(waiter, timeout, [&ready]() { return ready; });
-		if (success) {
-			return std::move(value);
-		}
-		else {
-			throw std::runtime_error("Future wait_for timeout");
+			default:
+				throw std::runtime_error("Future already retrieved");
+			}
+
+			// then() was called, the value goes there
+			if (state_->hasCallback()) {
+				throw std::runtime_error("Future already retrieved");
+			}
+
+			const auto now = std::chrono::steady_clock::now();
+			if (now >= deadline) {
+				throw std::runtime_error("Future wait_for timeout");
+			}
+
+			if (fiber) {
+				return _waitInFiber(fiber, helper, timeout);
+			}
+
+			if (helper) {
+				/*
+				We are a worker of helper, the value may depend on work queued
+				behind us. Run that work instead of blocking this worker, only
+				sleep a short while when there is nothing to run
+				*/
+				if (!helper->runPendingTask()) {
+					state_->waitUntil(std::min(deadline, now + kHelpWaitSlice));
+				}
+			}
+			else {
+				state_->waitUntil(deadline);
+			}
 		}
 	}
 
@@ -380,38 +923,31 @@ public:
 
 		static_assert(std::is_same<SHIT, Future<InnerType>>::value, "Kidding me?");
 
+		if (local_ != Progress::None) {
+			auto innerFuture = _takeLocal();
+			if (innerFuture.hasException()) {
+				return SHIT(typename TryWrapper<InnerType>::Type(innerFuture.exception()));
+			}
+
+			return std::move(innerFuture.value());
+		}
+
 		Promise<InnerType> prom;
 		Future<InnerType> fut = prom.getFuture();
 
-		std::unique_lock<std::mutex> guard(state_->thenLock_);
-		if (state_->progress_ == Progress::Timeout) {
-			throw std::runtime_error("Wrong state: Timeout");
-		}
-		else if (state_->progress_ == Progress::Done) {
+		// Runs at once if the outer value is already there
+		bool alive = _setCallback([pm = std::move(prom)](typename TryWrapper<SHIT>::Type&& innerFuture) mutable {
 			try {
-				auto innerFuture = std::move(state_->value_);
-				return std::move(innerFuture.value());
+				SHIT future = std::move(innerFuture.value());
+				future._forward(std::move(pm));
 			}
-			catch (const std::exception& e) {
-				return makeExceptionFuture<InnerType>(std::current_exception());
+			catch (...) {
+				pm.setException(std::current_exception());
 			}
-		}
-		else {
-			_setCallback([pm = std::move(prom)](typename TryWrapper<SHIT>::Type&& innerFuture) mutable {
-				try {
-					SHIT future = std::move(innerFuture);
-					future._setCallback([pm = std::move(pm)](typename TryWrapper<InnerType>::Type&& t) mutable {
-						// No need scheduler here, think about this code:
-						// `outer.Unwrap().Then(sched, func);`
-						// outer.Unwrap() is the inner future, the below line
-						// will trigger func in sched thread.
-						pm.setValue(std::move(t));
-					});
-				}
-				catch (...) {
-					pm.setException(std::current_exception());
-				}
-			});
+		});
+
+		if (!alive) {
+			throw std::runtime_error("Wrong state: Timeout");
 		}
 
 		return fut;
@@ -454,8 +990,14 @@ public:
 		// R应该是个CallableResult，那么R::IsReturnsFuture::Inner指的就是函数调用得到结果的type
 		using FReturnType = typename R::IsReturnsFuture::Inner;
 
+		// The value is here and needn't hop to a scheduler, no State is needed
+		if (local_ != Progress::None && !sched) {
+			return typename R::ReturnFutureType(WrapWithTry(std::forward<F>(f), _takeLocal()));
+		}
+
 		Promise<FReturnType> pm;
 		auto nextFuture = pm.getFuture();
+		_shareCancel(pm);
 
 		/*
 		std::decay<T>::type
@@ -464,67 +1006,34 @@ public:
 		*/
 		using FuncType = typename std::decay<F>::type;
 
-		std::unique_lock<std::mutex> guard(state_->thenLock_);
-		if (state_->progress_ == Progress::Timeout) {
-			throw std::runtime_error("Wrong state: Timeout");
-		}
-		else if (state_->progress_ == Progress::Done) {
-			typename TryWrapper<T>::Type t;
-
-			try {
-				t = std::move(state_->value_);
-			}
-			catch (const std::exception& e) {
-				t = (typename TryWrapper<T>::Type)(std::current_exception());
+		/*
+		_setCallback接受的参数是一个lambda
+		在这个lambda的init capture中，有三个参数
+		sched，一个Scheduler的指针
+		func，传进来的function
+		prom，刚刚创建的promise
+		这个lambda接受一个参数，一个被Try struct包裹的type
+
+		如果value已经被设置，这个lambda在这里立即被调用，否则由setValue的线程调用
+		在这个lambda中，把func调用t的结果使用Try包裹了一下，然后将prom的value设定成这个结果
+		*/
+		bool alive = _setCallback(
+			[sched, func = std::forward<FuncType>(f), prom = std::move(pm)]
+			(typename TryWrapper<T>::Type&& t) mutable {
+				// A cancelled chain fails here without calling func
+				if (sched) {
+					sched->schedule([func = std::move(func), t = std::move(t), prom = std::move(prom)]() mutable {
+						prom.setWith(func, std::move(t));
+					});
+				}
+				else {
+					prom.setWith(func, std::move(t));
+				}
 			}
+		);
 
-			guard.unlock();
-
-			if (sched) {
-				/*
-				首先来看看这个lambda的3个init caputure都是什么
-				t是一个被Try struct包裹的T type，它的值就是当前Future state_中的value
-				f是要调用的function
-				pm是之前刚刚创建的被F(Args...)所特化的Promise
-
-				接下来在这个lambda的过程中
-				首先把f调用t的结果使用Try包裹了一下，然后将pm的value设定成这个结果type
-				*/
-				sched->schedule([t = std::move(t), f = std::forward<FuncType>(f), pm = std::move(pm)]() mutable {
-					auto result = WrapWithTry(f, std::move(t));
-					pm.setValue(std::move(result));
-				});
-			}
-			else {
-				auto result = WrapWithTry(f, std::move(t));
-				pm.setValue(std::move(result));
-			}
-		}
-		else {
-			// Set this future's then callback
-			/*
-			_setCallback接受的参数是一个lambda
-			在这个lambda的init capture中，有三个参数
-			sched，一个Scheduler的指针
-			func，传进来的function
-			prom，刚刚创建的promise
-			这个lambda接受一个参数，一个被Try struct包裹的type
-			*/
-			_setCallback(
-				[sched, func = std::forward<FuncType>(f), prom = std::move(pm)]
-				(typename TryWrapper<T>::Type&& t) mutable {
-					if (sched) {
-						sched->schedule([func = std::move(func), t = std::move(t), prom = std::move(prom)]() mutable {
-							auto result = WrapWithTry(func, std::move(t));
-							prom.setValue(std::move(result));
-						});
-					}
-					else {
-						auto result = WrapWithTry(func, std::move(t));
-						prom.setValue(std::move(result));
-					}
-				}
-			);
+		if (!alive) {
+			throw std::runtime_error("Wrong state: Timeout");
 		}
 
 		return std::move(nextFuture);
@@ -538,68 +1047,50 @@ public:
 
 		using FReturnType = typename R::IsReturnsFuture::Inner;
 
+		// The value is here, return the callback's future as it is
+		if (local_ != Progress::None && !sched) {
+			auto t = _takeLocal();
+			if (t.hasException()) {
+				return std::forward<F>(f)(typename TryWrapper<typename std::decay<Args...>::type>::Type(t.exception()));
+			}
+
+			return std::forward<F>(f)(t.template get<Args>()...);
+		}
+
 		Promise<FReturnType> pm;
 		auto nextFuture = pm.getFuture();
+		_shareCancel(pm);
 
 		using FuncType = typename std::decay<F>::type;
 
-		std::unique_lock<std::mutex> guard(state_->thenLock_);
-		if (state_->progress_ == Progress::Timeout) {
-			throw std::runtime_error("Wrong state: Timeout");
-		}
-		else if (state_->progress_ == Progress::Done) {
-			typename TryWrapper<T>::Type t;
-
-			try {
-				t = std::move(state_->value_);
-			}
-			catch (const std::exception& e) {
-				t = decltype(t)(std::current_exception());
-			}
-
-			guard.unlock();
+		// Set this future's then callback, it's called at once if the value is already there
+		bool alive = _setCallback([sched = sched, func = std::forward<FuncType>(f), prom = std::move(pm)](typename TryWrapper<T>::Type && t) mutable {
+			auto cb = [func = std::move(func), t = std::move(t), prom = std::move(prom)]() mutable {
+				if (prom.isCancelled()) {
+					prom.setException(std::make_exception_ptr(CancelledError()));
+					return;
+				}
 
-			auto cb = [res = std::move(t), f = std::forward<FuncType>(f), prom = std::move(pm)]() mutable {
-				// func return another future: innerFuture, when innerFuture is done, nextFuture can be done
+				// because func return another future: innerFuture, when innerFuture is done, nextFuture can be done
 				/*
-				这里的语法有点奇怪，其实并不是res.template，而是res.(template get<Args>()...)
-				指的是使用Args去特化get这个函数然后在res上进行调用
+				这里的语法有点奇怪，其实并不是t.template，而是t.(template get<Args>()...)
+				指的是使用Args去特化get这个函数然后在t上进行调用
 				*/
-				decltype(f(res.template get<Args>()...)) innerFuture;
-				if (res.hasException()) {
+				decltype(func(t.template get<Args>()...)) innerFuture;
+				CancelScope scope(prom.state_.get());
+				if (t.hasException()) {
 					// Failed if Args... is void
-					innerFuture = f(typename TryWrapper<typename std::decay<Args...>::type>::Type(res.exception()));
+					innerFuture = func(typename TryWrapper<typename std::decay<Args...>::type>::Type(t.exception()));
 				}
 				else {
-					innerFuture = f(res.template get<Args>()...);
+					innerFuture = func(t.template get<Args>()...);
 				}
 
 				if (!innerFuture.valid()) {
 					return;
 				}
 
-				std::unique_lock<std::mutex> guard(innerFuture.state_->thenLock_);
-				if (innerFuture.state_->progress_ == Progress::Timeout) {
-					throw std::runtime_error("Wrong state: Timeout");
-				}
-				else if (innerFuture.state_->progress_ == Progress::Done) {
-					typename TryWrapper<FReturnType>::Type t;
-
-					try {
-						t = std::move(innerFuture.state_->value_);
-					}
-					catch (const std::exception& e) {
-						t = decltype(t)(std::current_exception());
-					}
-
-					guard.unlock();
-					prom.setValue(std::move(t));
-				}
-				else {
-					innerFuture._setCallback([prom = std::move(prom)](typename TryWrapper<FReturnType>::Type&& t) mutable {
-						prom.setValue(std::move(t));
-					});
-				}
+				innerFuture._forward(std::move(prom));
 			};
 
 			if (sched) {
@@ -608,57 +1099,48 @@ public:
 			else {
 				cb();
 			}
+		});
+
+		if (!alive) {
+			throw std::runtime_error("Wrong state: Timeout");
 		}
-		else {
-			// Set this future's then callback
-			_setCallback([sched = sched, func = std::forward<FuncType>(f), prom = std::move(pm)](typename TryWrapper<T>::Type && t) mutable {
-				auto cb = [func = std::move(func), t = std::move(t), prom = std::move(prom)]() mutable {
-					// because func return another future: innerFuture, when innerFuture is done, nextFuture can be done
-					decltype(func(t.template get<Args>()...)) innerFuture;
-					if (t.hasException()) {
-						// Failed if Args... is void
-						innerFuture = func(typename TryWrapper<typename std::decay<Args...>::type>::Type(t.exception()));
-					}
-					else {
-						innerFuture = func(t.template get<Args>()...);
-					}
 
-					if (!innerFuture.valid()) {
-						return;
-					}
-					std::unique_lock<std::mutex> guard(innerFuture.state_->thenLock_);
-					if (innerFuture.state_->progress_ == Progress::Timeout) {
-						throw std::runtime_error("Wrong state : Timeout");
-					}
-					else if (innerFuture.state_->progress_ == Progress::Done) {
-						typename TryWrapper<FReturnType>::Type t;
-						try {
-							t = std::move(innerFuture.state_->value_);
-						}
-						catch (const std::exception& e) {
-							t = decltype(t)(std::current_exception());
-						}
-
-						guard.unlock();
-						prom.setValue(std::move(t));
-					}
-					else {
-						innerFuture._setCallback([prom = std::move(prom)](typename TryWrapper<FReturnType>::Type&& t) mutable {
-							prom.setValue(std::move(t));
-						});
-					}
-				};
+		return std::move(nextFuture);
+	}
 
-				if (sched) {
-					sched->schedule(std::move(cb));
-				}
-				else {
-					cb();
-				}
-			});
+	/*
+	* A future with our value, or failing with TimeoutError if the value
+	* hasn't come within duration. The steps producing it are cancelled then,
+	* the steps after it get the TimeoutError.
+	*
+	*		auto user = loadUser(id).within(std::chrono::milliseconds(50));
+	*
+	* Unlike onTimeout it's a step of the chain, like then(), and it needs no
+	* scheduler: the deadline is an entry of the process wide TimerWheel, and
+	* a value coming first takes it off in O(1). The timeout is set on the
+	* wheel thread, continuations doing real work should go to a scheduler.
+	*/
+	Future<T> within(std::chrono::milliseconds duration) {
+		return withDeadline(std::chrono::steady_clock::now() + duration);
+	}
+
+	Future<T> withDeadline(const std::chrono::steady_clock::time_point& deadline) {
+		// A ready future is never late
+		if (!state_) {
+			return std::move(*this);
 		}
 
-		return std::move(nextFuture);
+		Promise<T> pm;
+		auto nextFuture = pm.getFuture();
+		// A token of its own, the timeout cancels only the steps before
+		pm.state_->cancelState()->link(state_->cancelState());
+
+		auto entry = new DeadlineEntry<T>(std::move(pm), state_->cancelState());
+		TimerWheel::instance().add(entry, deadline);
+
+		_onResult(typename DeadlineEntry<T>::ValueRef(entry));
+
+		return nextFuture;
 	}
 
 	/*
@@ -682,67 +1164,203 @@ public:
 	* 2. xx and yy are called, and zz is called, aha, it's rarely happend but...
 	* 3. xx and yy are called, it's the normal case.
 	* So, you may shouldn't use OnTimeout with chained futures!!!
+	* within() has none of this, prefer it.
 	*/
+	/*
+	* Ask the producers of this future, and of the steps chained before it,
+	* to stop. Steps not started yet are dropped and fail with CancelledError,
+	* so do the then() steps after it. A running step finishes unless it polls
+	* CancelScope::requested(), and a value already set is kept.
+	*
+	*		auto f = pool.execute(parse).then(index).then(store);
+	*		f.cancel();     // whatever of parse, index and store hasn't run, won't
+	*/
+	void cancel() {
+		// A ready future has nothing left to run
+		if (state_) {
+			state_->cancelState()->cancel();
+		}
+	}
+
 	void onTimeout(std::chrono::milliseconds duration, std::function<void()> f, Scheduler* scheduler) {
+		// A ready future can't time out
+		if (!state_) {
+			return;
+		}
+
 		scheduler->schedulerLater(duration, [state = state_, cb = std::move(f)]() mutable {
-			std::unique_lock<std::mutex> guard(state->thenLock_);
-			if (state->progress_ != Progress::None) {
-				return;
+			// Lost to the value, or already timed out
+			if (state->setTimeout()) {
+				cb();
 			}
-
-			state->progress_ = Progress::Timeout;
-			guard.unlock();
-
-			cb();
 		});
 	}
 
 private:
 
-	void _setCallback(std::function<void (typename TryWrapper<T>::Type&&)>&& func) {
-		state_->then_ = std::move(func);
+	// Future<U>::_thenImpl forwards the future its callback returns
+	template<typename U>
+	friend class Future;
+
+	// collectAll and friends hook their callbacks directly, without a then() step
+	friend class Collector;
+
+	// retryWithBackoff and hedge cancel the calls they make
+	friend class Retrier;
+
+	// co_await resumes the coroutine from the callback, see Coroutine.h
+	template<typename U>
+	friend class FutureAwaiter;
+
+	/*
+	Call f with our value when it's there, without a then() step. A future
+	which has timed out is never set, f gets a TimeoutError at once then
+	*/
+	template<typename F>
+	void _onResult(F&& f) {
+		typename State<T>::Callback cb(std::forward<F>(f));
+		// It stays ours when _setCallback fails
+		if (!_setCallback(std::move(cb))) {
+			cb(typename TryWrapper<T>::Type(std::make_exception_ptr(TimeoutError())));
+		}
 	}
 
-	void _setOnTimeout(std::function<void(std::function<void()>&&)>&& func) {
-		state_->onTimeout_ = std::move(func);
+	// Returns false if it has timed out, func is never called then
+	bool _setCallback(Function<void (typename TryWrapper<T>::Type&&)>&& func) {
+		if (local_ != Progress::None) {
+			func(_takeLocal());
+			return true;
+		}
+
+		return state_->setCallback(std::move(func));
 	}
 
-	std::shared_ptr<State<T>> state_;
+	// Move out the value a ready future was created with, only once
+	typename TryWrapper<T>::Type _takeLocal() {
+		if (local_ == Progress::Retrieved) {
+			throw std::runtime_error("Future already retrieved");
+		}
+
+		local_ = Progress::Retrieved;
+		return std::move(value_);
+	}
+
+	/*
+	Park the fiber until the value comes, its thread runs other work meanwhile
+	The value is handed over by a callback, so a timed out wait leaves
+	the future retrieved, unlike a wait on a thread
+	*/
+	typename TryWrapper<T>::Type _waitInFiber(Suspender* fiber, Scheduler* timer, const std::chrono::milliseconds& timeout) {
+		using ValueType = typename TryWrapper<T>::Type;
+
+		struct Parked {
+			Parked() :
+				woken(false),
+				outcome(Progress::None) {
+			}
+
+			// The value, a timeout or the timer, first one resumes the fiber
+			std::atomic<bool> woken;
+			Task resume;
+			ValueType value;
+			Progress outcome;
+		};
+
+		auto parked = std::make_shared<Parked>();
+		StateRef<T> state = state_;
+		if (timeout >= kWaitForever) {
+			timer = nullptr;
+		}
+
+		fiber->suspend([parked, state, timer, timeout](Task&& resume) {
+			parked->resume = std::move(resume);
+
+			const bool alive = state->setCallback([parked](ValueType&& t) {
+				if (!parked->woken.exchange(true, std::memory_order_acq_rel)) {
+					parked->value = std::move(t);
+					parked->outcome = Progress::Done;
+					parked->resume();
+				}
+			});
+
+			if (!alive) {
+				if (!parked->woken.exchange(true, std::memory_order_acq_rel)) {
+					parked->outcome = Progress::Timeout;
+					parked->resume();
+				}
+			}
+			else if (timer) {
+				timer->schedulerLater(timeout, [parked]() {
+					if (!parked->woken.exchange(true, std::memory_order_acq_rel)) {
+						parked->resume();
+					}
+				});
+			}
+		});
+
+		switch (parked->outcome) {
+		case Progress::Done:
+			return std::move(parked->value);
+
+		case Progress::Timeout:
+			throw std::runtime_error("Future timeout");
+
+		default:
+			throw std::runtime_error("Future wait_for timeout");
+		}
+	}
+
+	// The next step shares our cancellation token, made now if we have none
+	template<typename U>
+	void _shareCancel(Promise<U>& next) {
+		if (state_) {
+			next.state_->followCancel(state_->cancelState());
+		}
+	}
+
+	// Set pm with our value when it's there, cancelling pm cancels us
+	void _forward(Promise<T>&& pm) {
+		if (state_) {
+			state_->followCancel(pm.state_->cancelState());
+		}
+
+		bool alive = _setCallback([pm = std::move(pm)](typename TryWrapper<T>::Type&& t) mutable {
+			pm.setValue(std::move(t));
+		});
+
+		if (!alive) {
+			throw std::runtime_error("Wrong state: Timeout");
+		}
+	}
+
+	StateRef<T> state_;
+
+	// Done while a ready future holds its value in value_, Retrieved once taken
+	Progress local_;
+	typename TryWrapper<T>::Type value_;
 };
 
-// Make ready future
+// Make ready future, it holds the value itself, nothing is allocated
 template<typename T2>
 inline Future<typename std::decay<T2>::type> makeReadyFuture(T2&& value) {
-	Promise<typename std::decay<T2>::type> pm;
-	auto f(pm.getFuture());
-	pm.setValue(std::forward<T2>(value));
+	using ValueType = typename std::decay<T2>::type;
 
-	return f;
+	return Future<ValueType>(typename TryWrapper<ValueType>::Type(std::forward<T2>(value)));
 }
 
 inline Future<void> makeReadyFuture() {
-	Promise<void> pm;
-	auto f(pm.getFuture());
-	pm.setValue();
-
-	return f;
+	return Future<void>(Try<void>());
 }
 
 // Make exception future
 template<typename T2, typename E>
 inline Future<T2> makeExceptionFuture(E&& exp) {
-	Promise<T2> pm;
-	pm.setException(std::make_exception_ptr(std::forward<E>(exp)));
-
-	return pm.getFuture();
+	return Future<T2>(typename TryWrapper<T2>::Type(std::make_exception_ptr(std::forward<E>(exp))));
 }
 
 template<typename T2>
 inline Future<T2> makeExceptionFuture(std::exception_ptr&& eptr) {
-	Promise<T2> pm;
-	pm.setException(std::move(eptr));
-
-	return pm.getFuture();
+	return Future<T2>(typename TryWrapper<T2>::Type(std::move(eptr)));
 }
 
 }  // namespace Quokka
\ No newline at end of file
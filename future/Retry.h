@@ -0,0 +1,308 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "Future.h"
+
+namespace Quokka {
+
+/*
+* When and how often retryWithBackoff tries again
+*
+* The nth retry waits initialDelay * multiplier^(n-1), capped at maxDelay,
+* shortened by a random part of up to jitter of it. With the default full
+* jitter, clients failing together don't come back together.
+*/
+struct RetryPolicy {
+	RetryPolicy() :
+		maxAttempts(3),
+		initialDelay(10),
+		maxDelay(1000),
+		multiplier(2.0),
+		jitter(1.0) {
+	}
+
+	// The first call included
+	std::size_t maxAttempts;
+	std::chrono::milliseconds initialDelay;
+	std::chrono::milliseconds maxDelay;
+	double multiplier;
+	// 0 waits the exact backoff, 1 anything between 0 and the backoff
+	double jitter;
+	// Which failures are worth another attempt, all of them if empty
+	std::function<bool(const std::exception_ptr&)> retryOn;
+
+	// The wait after failures failed attempts
+	std::chrono::milliseconds delayAfter(std::size_t failures) const {
+		static thread_local std::mt19937 random(std::random_device{}());
+
+		const double backoff = std::min(static_cast<double>(maxDelay.count()),
+			initialDelay.count() * std::pow(multiplier, static_cast<double>(failures - 1)));
+		std::uniform_real_distribution<double> part(0.0, std::max(0.0, std::min(jitter, 1.0)));
+
+		return std::chrono::milliseconds(static_cast<std::chrono::milliseconds::rep>(backoff * (1.0 - part(random))));
+	}
+};
+
+/*
+* Calls made again, in case the first one fails or is slow
+*
+* Both take f returning a Future and call it again as needed, waiting in
+* between with sched->schedulerLater, so no thread blocks meanwhile. The
+* calls after the first one are made on sched.
+*
+* Cancelling the returned future cancels the calls in flight, see
+* Future::cancel, and no new call is made.
+*/
+class Retrier {
+public:
+
+	template<typename F>
+	using FutureOf = typename std::result_of<F&()>::type;
+
+	template<typename F>
+	using ValueOf = typename TryWrapper<typename IsFuture<FutureOf<F>>::Inner>::Type;
+
+	template<typename F>
+	static FutureOf<F> backoff(Scheduler* sched, F&& f, const RetryPolicy& policy) {
+		using FutureType = FutureOf<F>;
+		static_assert(IsFuture<FutureType>::value, "f must return a Future");
+
+		struct Context {
+			Context(Scheduler* s, F&& f, const RetryPolicy& p) :
+				sched(s),
+				func(std::forward<F>(f)),
+				policy(p),
+				attempts(0),
+				token(nullptr) {
+			}
+
+			Scheduler* sched;
+			typename std::decay<F>::type func;
+			const RetryPolicy policy;
+			// One attempt in flight at a time, so no atomic
+			std::size_t attempts;
+			CancelState* token;
+			Promise<typename IsFuture<FutureType>::Inner> pm;
+		};
+
+		auto ctx = std::make_shared<Context>(sched, std::forward<F>(f), policy);
+		auto future = ctx->pm.getFuture();
+		ctx->token = future.state_->cancelState();
+
+		_attempt<FutureType>(ctx);
+		return future;
+	}
+
+	/*
+	Call f, and again after each delay without a result, up to maxCopies
+	calls in flight. The first success wins and the other calls are
+	cancelled, a failed call starts the next one at once. It fails only
+	when all maxCopies calls have failed, with the last error.
+	f may be called on several threads at once
+	*/
+	template<typename F>
+	static FutureOf<F> hedge(Scheduler* sched, F&& f, std::chrono::milliseconds delay, std::size_t maxCopies) {
+		using FutureType = FutureOf<F>;
+		static_assert(IsFuture<FutureType>::value, "f must return a Future");
+
+		struct Context {
+			Context(Scheduler* s, F&& f, std::chrono::milliseconds d, std::size_t n) :
+				sched(s),
+				func(std::forward<F>(f)),
+				delay(d),
+				maxCopies(n),
+				started(0),
+				failed(0),
+				done(false),
+				token(nullptr),
+				won(false) {
+			}
+
+			~Context() {
+				for (CancelState* copy : copies) {
+					copy->release();
+				}
+			}
+
+			Scheduler* sched;
+			typename std::decay<F>::type func;
+			const std::chrono::milliseconds delay;
+			const std::size_t maxCopies;
+			std::atomic<std::size_t> started;
+			std::atomic<std::size_t> failed;
+			std::atomic<bool> done;
+			CancelState* token;
+			Promise<typename IsFuture<FutureType>::Inner> pm;
+
+			// Tokens of the calls made, cancelled once one has won
+			std::mutex mutex;
+			std::vector<CancelState*> copies;
+			bool won;
+		};
+
+		auto ctx = std::make_shared<Context>(sched, std::forward<F>(f), delay, std::max<std::size_t>(maxCopies, 1));
+		auto future = ctx->pm.getFuture();
+		ctx->token = future.state_->cancelState();
+
+		_startCopy<FutureType>(ctx);
+		if (ctx->maxCopies > 1) {
+			_armHedge<FutureType>(ctx);
+		}
+
+		return future;
+	}
+
+private:
+
+	template<typename FutureType, typename Context>
+	static void _attempt(const std::shared_ptr<Context>& ctx) {
+		using ValueType = typename TryWrapper<typename IsFuture<FutureType>::Inner>::Type;
+
+		if (ctx->token->cancelled()) {
+			ctx->pm.setException(std::make_exception_ptr(CancelledError()));
+			return;
+		}
+
+		++ctx->attempts;
+		FutureType future = _call<FutureType>(ctx->func);
+		if (future.state_) {
+			ctx->token->link(future.state_->cancelState());
+		}
+
+		future._onResult([ctx](ValueType&& t) {
+			if (!t.hasException()) {
+				ctx->pm.setValue(std::move(t));
+				return;
+			}
+
+			const bool again = ctx->attempts < ctx->policy.maxAttempts &&
+				!ctx->token->cancelled() &&
+				(!ctx->policy.retryOn || ctx->policy.retryOn(t.exception()));
+			if (!again) {
+				ctx->pm.setValue(std::move(t));
+				return;
+			}
+
+			ctx->sched->schedulerLater(ctx->policy.delayAfter(ctx->attempts), [ctx]() {
+				_attempt<FutureType>(ctx);
+			});
+		});
+	}
+
+	template<typename FutureType, typename Context>
+	static void _startCopy(const std::shared_ptr<Context>& ctx) {
+		using ValueType = typename TryWrapper<typename IsFuture<FutureType>::Inner>::Type;
+
+		if (ctx->done.load(std::memory_order_acquire) ||
+			ctx->started.fetch_add(1, std::memory_order_acq_rel) >= ctx->maxCopies) {
+			return;
+		}
+
+		FutureType future = _call<FutureType>(ctx->func);
+		if (future.state_) {
+			CancelState* copy = future.state_->cancelState();
+			ctx->token->link(copy);
+
+			std::unique_lock<std::mutex> guard(ctx->mutex);
+			// Too late, a call made before has already won
+			if (ctx->won) {
+				copy->cancel();
+			}
+			else {
+				copy->addRef();
+				ctx->copies.push_back(copy);
+			}
+		}
+
+		future._onResult([ctx](ValueType&& t) {
+			if (!t.hasException()) {
+				if (!ctx->done.exchange(true, std::memory_order_acq_rel)) {
+					ctx->pm.setValue(std::move(t));
+					_cancelCopies(ctx);
+				}
+				return;
+			}
+
+			if (ctx->failed.fetch_add(1, std::memory_order_acq_rel) + 1 == ctx->maxCopies) {
+				if (!ctx->done.exchange(true, std::memory_order_acq_rel)) {
+					ctx->pm.setValue(std::move(t));
+				}
+				return;
+			}
+
+			if (ctx->token->cancelled()) {
+				if (!ctx->done.exchange(true, std::memory_order_acq_rel)) {
+					ctx->pm.setException(std::make_exception_ptr(CancelledError()));
+				}
+				return;
+			}
+
+			// Failed fast, don't wait for the delay to make the next call
+			_startCopy<FutureType>(ctx);
+		});
+	}
+
+	template<typename FutureType, typename Context>
+	static void _armHedge(const std::shared_ptr<Context>& ctx) {
+		ctx->sched->schedulerLater(ctx->delay, [ctx]() {
+			if (ctx->done.load(std::memory_order_acquire) || ctx->token->cancelled()) {
+				return;
+			}
+
+			_startCopy<FutureType>(ctx);
+			if (ctx->started.load(std::memory_order_acquire) < ctx->maxCopies) {
+				_armHedge<FutureType>(ctx);
+			}
+		});
+	}
+
+	template<typename Context>
+	static void _cancelCopies(const std::shared_ptr<Context>& ctx) {
+		std::unique_lock<std::mutex> guard(ctx->mutex);
+		ctx->won = true;
+		for (CancelState* copy : ctx->copies) {
+			copy->cancel();
+		}
+	}
+
+	// A throwing f counts as a failed call
+	template<typename FutureType, typename F>
+	static FutureType _call(F& func) {
+		using ValueType = typename TryWrapper<typename IsFuture<FutureType>::Inner>::Type;
+
+		try {
+			return func();
+		}
+		catch (...) {
+			return FutureType(ValueType(std::current_exception()));
+		}
+	}
+};
+
+// f() again after jittered, growing delays on sched, while it fails
+template<typename F>
+inline auto retryWithBackoff(Scheduler* sched, F&& f, const RetryPolicy& policy = RetryPolicy())
+	-> decltype(Retrier::backoff(sched, std::forward<F>(f), policy)) {
+	return Retrier::backoff(sched, std::forward<F>(f), policy);
+}
+
+// f() again every delay on sched while no call has succeeded, at most maxCopies calls
+template<typename F>
+inline auto hedge(Scheduler* sched, F&& f, std::chrono::milliseconds delay, std::size_t maxCopies = 2)
+	-> decltype(Retrier::hedge(sched, std::forward<F>(f), delay, maxCopies)) {
+	return Retrier::hedge(sched, std::forward<F>(f), delay, maxCopies);
+}
+
+}  // namespace Quokka
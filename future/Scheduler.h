@@ -1,7 +1,8 @@
 #pragma once
 
 #include <chrono>
-#include <functional>
+
+#include "Function.h"
 
 namespace Quokka {
 
@@ -10,8 +11,70 @@ public:
 
 	virtual ~Scheduler() {}
 
-	virtual void schedulerLater(std::chrono::milliseconds duration, std::function<void()> f) = 0;
-	virtual void schedule(std::function<void()> f) = 0;
+	virtual void schedulerLater(std::chrono::milliseconds duration, Task f) = 0;
+	virtual void schedule(Task f) = 0;
+
+	/*
+	* Run one queued task on the calling thread, returns false if there is
+	* none or the calling thread does not work for this scheduler.
+	* Future::wait uses it on the current() scheduler to help instead of
+	* blocking a worker
+	*/
+	virtual bool runPendingTask() {
+		return false;
+	}
+
+	// The scheduler the calling thread works for, nullptr if none
+	static Scheduler* current() {
+		return _current();
+	}
+
+	// Called by a scheduler on its own worker threads
+	static void setCurrent(Scheduler* sched) {
+		_current() = sched;
+	}
+
+private:
+
+	static Scheduler*& _current() {
+		static thread_local Scheduler* s_current = nullptr;
+		return s_current;
+	}
+};
+
+/*
+* A stackful task able to give its thread back, see util/Fiber.h
+*
+* Future::wait on a thread running one parks it instead of blocking the
+* thread, so the worker runs other work meanwhile.
+*/
+class Suspender {
+public:
+
+	virtual ~Suspender() {}
+
+	/*
+	Switch away from the running fiber, returns when it's resumed
+	arm is called once the fiber is off its thread, with the task resuming
+	it, which must be called exactly once
+	*/
+	virtual void suspend(Function<void(Task&&)>&& arm) = 0;
+
+	// The fiber running on the calling thread, nullptr if none
+	static Suspender* current() {
+		return _current();
+	}
+
+	static void setCurrent(Suspender* fiber) {
+		_current() = fiber;
+	}
+
+private:
+
+	static Suspender*& _current() {
+		static thread_local Suspender* s_current = nullptr;
+		return s_current;
+	}
 };
 
 }  // namespace Quokka
\ No newline at end of file
@@ -0,0 +1,266 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+
+namespace Quokka {
+
+// Resolution of TimerWheel
+constexpr std::chrono::milliseconds kWheelTick(1);
+
+/*
+* One hashed timing wheel for the deadlines of the whole process
+*
+* Time is cut in ticks of kWheelTick, a deadline goes to the slot of its tick,
+* modulo kSlots. One thread turns the wheel, visiting a slot per tick and
+* expiring what is due in it, entries due a later turn stay where they are.
+*
+* Entries are intrusive nodes of a doubly linked list per slot, owned by
+* the caller, so adding and removing one is O(1) and allocates nothing.
+* Each slot has its own lock, adding and removing on many threads at
+* once rarely contend, the wheel thread only holds one slot at a time.
+*
+* Expired entries run on the wheel thread, outside any lock, they should
+* only hand their work to someone else, like setting a promise.
+*/
+class TimerWheel {
+public:
+
+	using Clock = std::chrono::steady_clock;
+
+	static const std::size_t kSlots = 512;
+
+	class Entry {
+	public:
+
+		Entry() :
+			prev_(nullptr),
+			next_(nullptr),
+			tick_(0),
+			linked_(false) {
+		}
+
+		Entry(const Entry&) = delete;
+		Entry& operator=(const Entry&) = delete;
+
+		// Called once on the wheel thread, unless remove() got it first
+		virtual void onExpire() = 0;
+
+	protected:
+
+		virtual ~Entry() {
+		}
+
+	private:
+
+		friend class TimerWheel;
+
+		Entry* prev_;
+		Entry* next_;
+		uint64_t tick_;
+		// Guarded by the lock of its slot
+		bool linked_;
+	};
+
+	TimerWheel() :
+		start_(Clock::now()),
+		processed_(0),
+		pending_(0),
+		stop_(false) {
+		thread_ = std::thread([this]() {
+			_turn();
+		});
+	}
+
+	~TimerWheel() {
+		{
+			std::unique_lock<std::mutex> guard(sleepMutex_);
+			stop_ = true;
+		}
+		sleepCond_.notify_one();
+		thread_.join();
+	}
+
+	TimerWheel(const TimerWheel&) = delete;
+	TimerWheel& operator=(const TimerWheel&) = delete;
+
+	static TimerWheel& instance() {
+		static TimerWheel wheel;
+		return wheel;
+	}
+
+	// entry->onExpire() is called at deadline, rounded up to the next tick
+	void add(Entry* entry, const Clock::time_point& deadline) {
+		const uint64_t due = _tickOf(deadline);
+		for (;;) {
+			// A tick already visited would only come again a turn later
+			const uint64_t tick = std::max(due, processed_.load(std::memory_order_acquire) + 1);
+			Slot& slot = slots_[tick % kSlots];
+
+			std::unique_lock<std::mutex> guard(slot.mutex);
+			// The wheel thread moves processed_ with the lock of the slot it visits
+			if (processed_.load(std::memory_order_acquire) >= tick) {
+				continue;
+			}
+
+			entry->tick_ = tick;
+			entry->prev_ = nullptr;
+			entry->next_ = slot.head;
+			if (slot.head) {
+				slot.head->prev_ = entry;
+			}
+			slot.head = entry;
+			entry->linked_ = true;
+			break;
+		}
+
+		if (pending_.fetch_add(1, std::memory_order_acq_rel) == 0) {
+			// The wheel thread may be asleep for good, with nothing to wait for
+			std::unique_lock<std::mutex> guard(sleepMutex_);
+			sleepCond_.notify_one();
+		}
+	}
+
+	/*
+	Take entry off the wheel, it won't expire anymore
+	Returns false if it has expired or is expiring right now, onExpire is
+	called or being called then
+	*/
+	bool remove(Entry* entry) {
+		Slot& slot = slots_[entry->tick_ % kSlots];
+		{
+			std::unique_lock<std::mutex> guard(slot.mutex);
+			if (!entry->linked_) {
+				return false;
+			}
+
+			_unlink(slot, entry);
+		}
+
+		pending_.fetch_sub(1, std::memory_order_relaxed);
+		return true;
+	}
+
+	// Entries added and neither expired nor removed yet
+	std::size_t pending() const {
+		return pending_.load(std::memory_order_relaxed);
+	}
+
+private:
+
+	struct Slot {
+		Slot() :
+			head(nullptr) {
+		}
+
+		std::mutex mutex;
+		Entry* head;
+	};
+
+	uint64_t _tickOf(const Clock::time_point& tp) const {
+		if (tp <= start_) {
+			return 0;
+		}
+
+		// Rounded up, an entry never expires before its deadline
+		return static_cast<uint64_t>((tp - start_ + kWheelTick - Clock::duration(1)) / kWheelTick);
+	}
+
+	static void _unlink(Slot& slot, Entry* entry) {
+		if (entry->prev_) {
+			entry->prev_->next_ = entry->next_;
+		}
+		else {
+			slot.head = entry->next_;
+		}
+
+		if (entry->next_) {
+			entry->next_->prev_ = entry->prev_;
+		}
+
+		entry->prev_ = entry->next_ = nullptr;
+		entry->linked_ = false;
+	}
+
+	void _turn() {
+		for (;;) {
+			{
+				std::unique_lock<std::mutex> guard(sleepMutex_);
+				if (pending_.load(std::memory_order_acquire) == 0) {
+					sleepCond_.wait(guard, [this]() {
+						return stop_ || pending_.load(std::memory_order_acquire) != 0;
+					});
+				}
+				else {
+					sleepCond_.wait_until(guard, start_ + (processed_.load(std::memory_order_relaxed) + 1) * kWheelTick, [this]() {
+						return stop_;
+					});
+				}
+
+				if (stop_) {
+					return;
+				}
+			}
+
+			const uint64_t now = static_cast<uint64_t>((Clock::now() - start_) / kWheelTick);
+			uint64_t tick = processed_.load(std::memory_order_relaxed) + 1;
+			// Back from a long sleep, one turn visits every slot
+			if (now >= tick + kSlots) {
+				tick = now - kSlots + 1;
+			}
+
+			for (; tick <= now; ++tick) {
+				_expire(tick);
+			}
+		}
+	}
+
+	void _expire(uint64_t tick) {
+		Entry* expired = nullptr;
+		{
+			Slot& slot = slots_[tick % kSlots];
+			std::unique_lock<std::mutex> guard(slot.mutex);
+			processed_.store(tick, std::memory_order_release);
+
+			Entry* entry = slot.head;
+			while (entry) {
+				Entry* next = entry->next_;
+				if (entry->tick_ <= tick) {
+					_unlink(slot, entry);
+					entry->next_ = expired;
+					expired = entry;
+				}
+				entry = next;
+			}
+		}
+
+		while (expired) {
+			Entry* next = expired->next_;
+			expired->next_ = nullptr;
+			pending_.fetch_sub(1, std::memory_order_relaxed);
+			// It may free itself, next was read before
+			expired->onExpire();
+			expired = next;
+		}
+	}
+
+	const Clock::time_point start_;
+	Slot slots_[kSlots];
+
+	// The last tick visited, moved only by the wheel thread
+	std::atomic<uint64_t> processed_;
+	std::atomic<std::size_t> pending_;
+
+	std::mutex sleepMutex_;
+	std::condition_variable sleepCond_;
+	bool stop_;
+	std::thread thread_;
+};
+
+}  // namespace Quokka
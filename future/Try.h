@@ -87,7 +87,7 @@ public:
 		this->~Try();
 
 		state_ = t.state_;
-		if (state_ == State::Exception) {
+		if (state_ == State::Value) {
 			new (&value_) T(t.value_);
 		}
 		else if (state_ == State::Exception) {
@@ -157,7 +157,7 @@ public:
 			throw std::runtime_error("Not exception state");
 		}
 
-		return exception_;
+		return std::move(exception_);
 	}
 
 	bool hasValue() const {
@@ -227,58 +227,34 @@ public:
 
 	// Move constructor
 	Try(Try<void>&& t) noexcept :
-		state_(t.state_) {
-		if (state_ == State::Exception) {
-			new (&exception_) std::exception_ptr(std::move(t.exception_));
-		}
+		state_(t.state_),
+		exception_(std::move(t.exception_)) {
 	}
 
 	// Move assignment operator
-	Try<void>& operator=(Try<void>& t) {
+	Try<void>& operator=(Try<void>&& t) noexcept {
 		if (this == &t) {
 			return *this;
 		}
 
-		this->~Try();
-
 		state_ = t.state_;
-		if (state_ == State::Exception) {
-			new (&exception_) std::exception_ptr(std::move(t.exception_));
-		}
-
+		exception_ = std::move(t.exception_);
 		return *this;
 	}
 
 	// Copy constructor
 	Try(const Try<void>& t) :
-		state_(t.state_) {
-		if (state_ == State::Exception) {
-			new (&exception_) std::exception_ptr(t.exception_);
-		}
+		state_(t.state_),
+		exception_(t.exception_) {
 	}
 
 	// Copy assignment operator
 	Try<void>& operator=(const Try<void>& t) {
-		if (this == &t) {
-			return *this;
-		}
-
-		this->~Try();
-
 		state_ = t.state_;
-		if (state_ == State::Exception) {
-			new (&exception_) std::exception_ptr(t.exception_);
-		}
-
+		exception_ = t.exception_;
 		return *this;
 	}
 
-	~Try() {
-		if (state_ == State::Exception) {
-			exception_.~exception_ptr();
-		}
-	}
-
 	const std::exception_ptr& exception() const & {
 		if (!hasException()) {
 			throw std::runtime_error("Not exception state");
@@ -296,7 +272,7 @@ public:
 	}
 
 	std::exception_ptr&& exception() && {
-		if (hasException()) {
+		if (!hasException()) {
 			throw std::runtime_error("Not exception state");
 		}
 
@@ -1,13 +1,22 @@
+#include <algorithm>
+#include <atomic>
 #include <iostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
 
 #include "util/StringView.h"
 #include "util/TimeUtil.h"
 #include "util/Timer.h"
 #include "util/ThreadPool.h"
+#include "util/KeyedStrands.h"
 
 #include "future/Helper.h"
 #include "future/Try.h"
 #include "future/Future.h"
+#include "future/Collect.h"
+#include "future/Retry.h"
 
 template<typename T>
 T threadFunc() {
@@ -54,4 +63,84 @@ int main() {
 	}).then([]() {
 		std::cout << "Finished" << std::endl;
 	});
+
+	auto squares = [&threadPool]() {
+		std::vector<Quokka::Future<int>> futures;
+		for (int i = 1; i <= 4; ++i) {
+			futures.push_back(threadPool.execute([i]() { return i * i; }));
+		}
+
+		return futures;
+	};
+
+	auto all = squares();
+	auto allResults = Quokka::collectAll(all.begin(), all.end()).wait();
+	std::cout << "collectAll got " << allResults.value().size() << " results" << std::endl;
+
+	auto any = squares();
+	auto anyResult = Quokka::collectAny(any.begin(), any.end()).wait();
+	std::cout << "collectAny got " << anyResult.value().second.value()
+		<< " from future " << anyResult.value().first << std::endl;
+
+	auto some = squares();
+	auto someResults = Quokka::collectN(some.begin(), some.end(), 2).wait();
+	std::cout << "collectN got the first " << someResults.value().size() << " results" << std::endl;
+
+	std::vector<int> inputs{ 1, 2, 3, 4, 5, 6 };
+	auto doubled = Quokka::collectWithConcurrency(inputs.begin(), inputs.end(), 2, [&threadPool](int v) {
+		return threadPool.execute([v]() { return v * 2; });
+	}).wait();
+	std::cout << "collectWithConcurrency got " << doubled.value().size() << " results, 2 at a time" << std::endl;
+
+	std::atomic<int> attempts(0);
+	auto retried = Quokka::retryWithBackoff(&threadPool, [&threadPool, &attempts]() {
+		return threadPool.execute([&attempts]() {
+			if (++attempts < 3) {
+				throw std::runtime_error("flaky");
+			}
+			return attempts.load();
+		});
+	}).wait();
+	std::cout << "retryWithBackoff succeeded at attempt " << retried.value() << std::endl;
+
+	std::atomic<int> copies(0);
+	auto hedged = Quokka::hedge(&threadPool, [&threadPool, &copies]() {
+		const int copy = ++copies;
+		return threadPool.execute([copy]() {
+			// The first call is slow, the hedged one wins
+			if (copy == 1) {
+				std::this_thread::sleep_for(std::chrono::milliseconds(100));
+			}
+			return copy;
+		});
+	}, std::chrono::milliseconds(10)).wait();
+	std::cout << "hedge got its value from call " << hedged.value() << std::endl;
+
+	// Each session's steps run in order, sessions run in parallel
+	Quokka::KeyedStrands<std::string> strands(&threadPool);
+	std::vector<Quokka::Future<void>> steps;
+	for (int i = 0; i < 3; ++i) {
+		for (const char* session : { "alice", "bob" }) {
+			steps.push_back(strands.execute(session, [session, i]() {
+				std::cout << std::string(session) + " step " + std::to_string(i) + "\n";
+			}));
+		}
+	}
+	Quokka::collectAll(steps.begin(), steps.end()).wait();
+
+	// Batches start about a thread per core, not one per task
+	Quokka::ThreadPool batchPool;
+	const uint64_t spawnedBefore = batchPool.stats().spawned;
+	std::vector<int> items(1000);
+	auto batch = batchPool.executeBatch(items, [](const int& v) { return v + 1; });
+	Quokka::collectAll(batch.begin(), batch.end()).wait();
+	std::atomic<long long> sum(0);
+	batchPool.parallelFor(0, 100000, 10, [&sum](int i) { sum += i; }).wait();
+
+	const uint64_t batchThreads = batchPool.stats().spawned - spawnedBefore;
+	std::cout << "executeBatch and parallelFor started " << batchThreads << " threads" << std::endl;
+	if (batchThreads > std::max(1U, std::thread::hardware_concurrency()) + 2) {
+		std::cerr << "Too many threads started for batches" << std::endl;
+		return 1;
+	}
 }
\ No newline at end of file
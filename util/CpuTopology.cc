@@ -0,0 +1,231 @@
+#include <algorithm>
+#include <cctype>
+#include <fstream>
+#include <map>
+#include <string>
+#include <thread>
+
+#ifdef __linux__
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include "CpuTopology.h"
+
+namespace Quokka {
+
+namespace {
+
+const char* const kCpuRoot = "/sys/devices/system/cpu";
+const char* const kNodeRoot = "/sys/devices/system/node";
+
+// Parse kernel cpu list format like "0-3,8,10-11"
+std::vector<int> parseCpuList(const std::string& list) {
+	std::vector<int> result;
+
+	std::size_t pos = 0;
+	while (pos < list.size()) {
+		std::size_t end = list.find(',', pos);
+		if (end == std::string::npos) {
+			end = list.size();
+		}
+
+		const std::string range = list.substr(pos, end - pos);
+		const std::size_t dash = range.find('-');
+		try {
+			if (dash == std::string::npos) {
+				result.push_back(std::stoi(range));
+			}
+			else {
+				const int first = std::stoi(range.substr(0, dash));
+				const int last = std::stoi(range.substr(dash + 1));
+				for (int i = first; i <= last; ++i) {
+					result.push_back(i);
+				}
+			}
+		}
+		catch (const std::exception&) {
+			// Ignore malformed or empty ranges, like the trailing newline
+		}
+
+		pos = end + 1;
+	}
+
+	return result;
+}
+
+bool readLine(const std::string& path, std::string& line) {
+	std::ifstream in(path);
+	return in && std::getline(in, line);
+}
+
+int readInt(const std::string& path, int defaultValue) {
+	std::string line;
+	if (!readLine(path, line)) {
+		return defaultValue;
+	}
+
+	try {
+		return std::stoi(line);
+	}
+	catch (const std::exception&) {
+		return defaultValue;
+	}
+}
+
+bool isAllowed(int cpu) {
+#ifdef __linux__
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	if (sched_getaffinity(0, sizeof(set), &set) != 0) {
+		return true;
+	}
+
+	return cpu < CPU_SETSIZE && CPU_ISSET(cpu, &set);
+#else
+	return true;
+#endif
+}
+
+// cpu -> node, empty if there is no NUMA info
+std::map<int, int> readNodes() {
+	std::map<int, int> nodes;
+
+#ifdef __linux__
+	DIR* dir = opendir(kNodeRoot);
+	if (dir == nullptr) {
+		return nodes;
+	}
+
+	while (dirent* entry = readdir(dir)) {
+		const std::string name(entry->d_name);
+		if (name.compare(0, 4, "node") != 0 || name.size() == 4 ||
+			!std::all_of(name.begin() + 4, name.end(), ::isdigit)) {
+			continue;
+		}
+
+		std::string list;
+		if (!readLine(std::string(kNodeRoot) + "/" + name + "/cpulist", list)) {
+			continue;
+		}
+
+		const int node = std::stoi(name.substr(4));
+		for (int cpu : parseCpuList(list)) {
+			nodes[cpu] = node;
+		}
+	}
+
+	closedir(dir);
+#endif
+
+	return nodes;
+}
+
+}  // end namespace
+
+CpuTopology CpuTopology::detect() {
+	CpuTopology topo;
+
+	std::string online;
+	std::vector<int> ids;
+	if (readLine(std::string(kCpuRoot) + "/online", online)) {
+		ids = parseCpuList(online);
+	}
+
+	if (ids.empty()) {
+		const int n = static_cast<int>(std::max(1U, std::thread::hardware_concurrency()));
+		for (int i = 0; i < n; ++i) {
+			ids.push_back(i);
+		}
+	}
+
+	const auto nodes = readNodes();
+
+	for (int id : ids) {
+		if (!isAllowed(id)) {
+			continue;
+		}
+
+		const std::string dir = std::string(kCpuRoot) + "/cpu" + std::to_string(id) + "/topology/";
+
+		CpuInfo info;
+		info.cpu = id;
+		info.core = readInt(dir + "core_id", id);
+		info.package = readInt(dir + "physical_package_id", 0);
+
+		auto it = nodes.find(id);
+		info.node = (it == nodes.end() ? 0 : it->second);
+
+		topo.cpus_.push_back(info);
+	}
+
+	int maxNode = 0;
+	for (const auto& info : topo.cpus_) {
+		maxNode = std::max(maxNode, info.node);
+	}
+	topo.nodeCount_ = maxNode + 1;
+
+	return topo;
+}
+
+const std::vector<CpuInfo>& CpuTopology::cpus() const {
+	return cpus_;
+}
+
+int CpuTopology::nodeCount() const {
+	return nodeCount_;
+}
+
+std::vector<CpuInfo> CpuTopology::placementOrder() const {
+	// Per node, first sibling of every core, then the second ones...
+	std::vector<std::vector<CpuInfo>> perNode(nodeCount_);
+	{
+		std::map<std::pair<int, int>, int> seenCores;
+		std::vector<std::pair<int, CpuInfo>> ranked;
+		for (const auto& info : cpus_) {
+			const int sibling = seenCores[std::make_pair(info.package, info.core)]++;
+			ranked.push_back(std::make_pair(sibling, info));
+		}
+
+		std::stable_sort(ranked.begin(), ranked.end(),
+			[](const std::pair<int, CpuInfo>& a, const std::pair<int, CpuInfo>& b) {
+				return a.first < b.first;
+			});
+
+		for (const auto& r : ranked) {
+			perNode[r.second.node].push_back(r.second);
+		}
+	}
+
+	// Interleave nodes
+	std::vector<CpuInfo> order;
+	for (std::size_t i = 0; order.size() < cpus_.size(); ++i) {
+		for (const auto& node : perNode) {
+			if (i < node.size()) {
+				order.push_back(node[i]);
+			}
+		}
+	}
+
+	return order;
+}
+
+bool CpuTopology::pinCurrentThread(int cpu) {
+#ifdef __linux__
+	if (cpu < 0 || cpu >= CPU_SETSIZE) {
+		return false;
+	}
+
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+
+	return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+	(void)cpu;
+	return false;
+#endif
+}
+
+}  // namespace Quokka
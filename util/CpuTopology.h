@@ -0,0 +1,48 @@
+#pragma once
+
+#include <vector>
+
+namespace Quokka {
+
+struct CpuInfo {
+	// Logical cpu id, as used by sched_setaffinity
+	int cpu;
+	// Physical core id inside its package, SMT siblings share it
+	int core;
+	// Physical package (socket) id
+	int package;
+	// NUMA node id
+	int node;
+};
+
+/*
+* Cpu layout of this machine, read from /sys/devices/system/cpu
+*
+* Only cpus this process is allowed to run on are listed. If sysfs is not
+* available, falls back to hardware_concurrency cpus on node 0.
+*/
+class CpuTopology {
+public:
+
+	static CpuTopology detect();
+
+	const std::vector<CpuInfo>& cpus() const;
+	int nodeCount() const;
+
+	/*
+	* Order to place workers in:
+	* nodes are interleaved so workers spread over all of them,
+	* and inside a node one cpu per physical core comes before SMT siblings
+	*/
+	std::vector<CpuInfo> placementOrder() const;
+
+	// Returns false if not supported or the cpu is not allowed
+	static bool pinCurrentThread(int cpu);
+
+private:
+
+	std::vector<CpuInfo> cpus_;
+	int nodeCount_ = 1;
+};
+
+}  // namespace Quokka
@@ -0,0 +1,350 @@
+#include <cstdint>
+#include <cstdlib>
+#include <exception>
+#include <new>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "Fiber.h"
+
+#if defined(__SANITIZE_ADDRESS__)
+#define QUOKKA_FIBER_ASAN 1
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define QUOKKA_FIBER_ASAN 1
+#endif
+#endif
+
+#if defined(__SANITIZE_THREAD__)
+#define QUOKKA_FIBER_TSAN 1
+#elif defined(__has_feature)
+#if __has_feature(thread_sanitizer)
+#define QUOKKA_FIBER_TSAN 1
+#endif
+#endif
+
+#ifdef QUOKKA_FIBER_ASAN
+#include <sanitizer/asan_interface.h>
+#include <sanitizer/common_interface_defs.h>
+#endif
+
+#ifdef QUOKKA_FIBER_TSAN
+#include <sanitizer/tsan_interface.h>
+#endif
+
+#ifndef QUOKKA_FIBER_USE_UCONTEXT
+/*
+Saves the callee saved registers and the SSE/x87 control words on the
+current stack, stores the stack pointer to *from, then does the reverse
+from the stack at to. A new fiber's stack is laid out so the final ret
+lands in the trampoline, with the fiber in r12 and the entry in r13
+*/
+extern "C" void quokka_fiber_switch(void** from, void* to);
+extern "C" void quokka_fiber_trampoline();
+
+asm(R"(
+	.text
+	.globl quokka_fiber_switch
+	.hidden quokka_fiber_switch
+	.type quokka_fiber_switch, @function
+quokka_fiber_switch:
+	pushq %rbp
+	pushq %rbx
+	pushq %r12
+	pushq %r13
+	pushq %r14
+	pushq %r15
+	subq $16, %rsp
+	stmxcsr 8(%rsp)
+	fnstcw 12(%rsp)
+	movq %rsp, (%rdi)
+	movq %rsi, %rsp
+	ldmxcsr 8(%rsp)
+	fldcw 12(%rsp)
+	addq $16, %rsp
+	popq %r15
+	popq %r14
+	popq %r13
+	popq %r12
+	popq %rbx
+	popq %rbp
+	ret
+	.size quokka_fiber_switch, .-quokka_fiber_switch
+
+	.globl quokka_fiber_trampoline
+	.hidden quokka_fiber_trampoline
+	.type quokka_fiber_trampoline, @function
+quokka_fiber_trampoline:
+	movq %r12, %rdi
+	callq *%r13
+	ud2
+	.size quokka_fiber_trampoline, .-quokka_fiber_trampoline
+)");
+#endif
+
+namespace Quokka {
+
+namespace {
+
+std::size_t pageSize() {
+	static const std::size_t size = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+	return size;
+}
+
+}  // end namespace
+
+const std::size_t FiberStackPool::kDefaultStackSize;
+const std::size_t FiberStackPool::kDefaultMaxCached;
+
+FiberStackPool::FiberStackPool(std::size_t stackSize, std::size_t maxCached) :
+	stackSize_((stackSize + pageSize() - 1) / pageSize() * pageSize()),
+	maxCached_(maxCached) {
+}
+
+FiberStackPool::~FiberStackPool() {
+	for (auto& stack : free_) {
+		munmap(static_cast<char*>(stack.base) - pageSize(), stack.size + pageSize());
+	}
+}
+
+FiberStack FiberStackPool::acquire() {
+	{
+		std::unique_lock<std::mutex> guard(mutex_);
+		if (!free_.empty()) {
+			FiberStack stack = free_.back();
+			free_.pop_back();
+			guard.unlock();
+
+#ifdef QUOKKA_FIBER_ASAN
+			// Frames of the last fiber which never returned are still poisoned
+			ASAN_UNPOISON_MEMORY_REGION(stack.base, stack.size);
+#endif
+			return stack;
+		}
+	}
+
+	const std::size_t guard = pageSize();
+	void* p = mmap(nullptr, stackSize_ + guard, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED) {
+		throw std::bad_alloc();
+	}
+
+	// Stacks grow down, the guard page is the lowest one
+	if (mprotect(p, guard, PROT_NONE) != 0) {
+		munmap(p, stackSize_ + guard);
+		throw std::bad_alloc();
+	}
+
+	FiberStack stack;
+	stack.base = static_cast<char*>(p) + guard;
+	stack.size = stackSize_;
+	return stack;
+}
+
+void FiberStackPool::release(FiberStack stack) {
+	{
+		std::unique_lock<std::mutex> guard(mutex_);
+		if (free_.size() < maxCached_) {
+			free_.push_back(stack);
+			return;
+		}
+	}
+
+	munmap(static_cast<char*>(stack.base) - pageSize(), stack.size + pageSize());
+}
+
+std::size_t FiberStackPool::stackSize() const {
+	return stackSize_;
+}
+
+FiberStackPool& FiberStackPool::instance() {
+	static FiberStackPool pool(kDefaultStackSize);
+	return pool;
+}
+
+void Fiber::start(Scheduler* home, Task f, FiberStackPool& stacks) {
+	home->schedule(launcher(home, std::move(f), stacks));
+}
+
+Task Fiber::launcher(Scheduler* home, Task f, FiberStackPool& stacks) {
+	// Owns the fiber until it first runs, a scheduler refusing it frees it
+	struct Launch {
+		explicit Launch(Fiber* f) :
+			fiber(f) {
+		}
+
+		Launch(Launch&& rhs) noexcept :
+			fiber(rhs.fiber) {
+			rhs.fiber = nullptr;
+		}
+
+		~Launch() {
+			delete fiber;
+		}
+
+		void operator()() {
+			Fiber* started = fiber;
+			fiber = nullptr;
+			started->_run();
+		}
+
+		Fiber* fiber;
+	};
+
+	return Launch(new Fiber(home, std::move(f), stacks));
+}
+
+Fiber::Fiber(Scheduler* home, Task f, FiberStackPool& stacks) :
+	home_(home),
+	body_(std::move(f)),
+	stacks_(stacks),
+	stack_(stacks.acquire()),
+	done_(false),
+	cancelScope_(nullptr),
+	callerStackBottom_(nullptr),
+	callerStackSize_(0),
+	asanFakeStack_(nullptr),
+	tsanFiber_(nullptr),
+	tsanCaller_(nullptr) {
+#ifdef QUOKKA_FIBER_USE_UCONTEXT
+	getcontext(&context_);
+	context_.uc_stack.ss_sp = stack_.base;
+	context_.uc_stack.ss_size = stack_.size;
+	context_.uc_link = nullptr;
+
+	// makecontext only passes ints
+	const uintptr_t self = reinterpret_cast<uintptr_t>(this);
+	makecontext(&context_, reinterpret_cast<void (*)()>(&Fiber::_ucontextEntry), 2,
+		static_cast<unsigned int>(static_cast<uint64_t>(self) >> 32), static_cast<unsigned int>(self & 0xffffffffu));
+#else
+	// The frame quokka_fiber_switch pops, ending with the return address
+	uintptr_t top = reinterpret_cast<uintptr_t>(stack_.base) + stack_.size;
+	top &= ~static_cast<uintptr_t>(15);
+
+	uint64_t* frame = reinterpret_cast<uint64_t*>(top - 88);
+	frame[0] = 0;
+	// mxcsr and x87 control word, their defaults
+	frame[1] = 0x1f80ULL | (0x037fULL << 32);
+	frame[2] = 0;                                                   // r15
+	frame[3] = 0;                                                   // r14
+	frame[4] = reinterpret_cast<uint64_t>(&Fiber::_entry);         // r13
+	frame[5] = reinterpret_cast<uint64_t>(this);                    // r12
+	frame[6] = 0;                                                   // rbx
+	frame[7] = 0;                                                   // rbp
+	frame[8] = reinterpret_cast<uint64_t>(&quokka_fiber_trampoline);
+	sp_ = frame;
+	callerSp_ = nullptr;
+#endif
+
+#ifdef QUOKKA_FIBER_TSAN
+	tsanFiber_ = __tsan_create_fiber(0);
+#endif
+}
+
+Fiber::~Fiber() {
+#ifdef QUOKKA_FIBER_TSAN
+	__tsan_destroy_fiber(tsanFiber_);
+#endif
+	stacks_.release(stack_);
+}
+
+void Fiber::suspend(Function<void(Task&&)>&& arm) {
+	arm_ = std::move(arm);
+	_switchOut();
+}
+
+void Fiber::_run() {
+	Suspender* outer = Suspender::current();
+	const StateBase* outerScope = CancelScope::current();
+	Suspender::setCurrent(this);
+	CancelScope::setCurrent(cancelScope_);
+	_switchIn();
+	cancelScope_ = CancelScope::current();
+	CancelScope::setCurrent(outerScope);
+	Suspender::setCurrent(outer);
+
+	if (done_) {
+		delete this;
+		return;
+	}
+
+	// Off its stack now, so whoever wakes it can't run it twice at once
+	Function<void(Task&&)> arm = std::move(arm_);
+	arm([this]() {
+		home_->schedule([this]() {
+			_run();
+		});
+	});
+}
+
+void Fiber::_switchIn() {
+#ifdef QUOKKA_FIBER_TSAN
+	tsanCaller_ = __tsan_get_current_fiber();
+	__tsan_switch_to_fiber(tsanFiber_, 0);
+#endif
+#ifdef QUOKKA_FIBER_ASAN
+	void* fakeStack = nullptr;
+	__sanitizer_start_switch_fiber(&fakeStack, stack_.base, stack_.size);
+#endif
+
+#ifdef QUOKKA_FIBER_USE_UCONTEXT
+	swapcontext(&callerContext_, &context_);
+#else
+	quokka_fiber_switch(&callerSp_, sp_);
+#endif
+
+#ifdef QUOKKA_FIBER_ASAN
+	__sanitizer_finish_switch_fiber(fakeStack, nullptr, nullptr);
+#endif
+}
+
+void Fiber::_switchOut() {
+#ifdef QUOKKA_FIBER_TSAN
+	__tsan_switch_to_fiber(tsanCaller_, 0);
+#endif
+#ifdef QUOKKA_FIBER_ASAN
+	// A finished fiber never comes back, its fake stack can go
+	__sanitizer_start_switch_fiber(done_ ? nullptr : &asanFakeStack_, callerStackBottom_, callerStackSize_);
+#endif
+
+#ifdef QUOKKA_FIBER_USE_UCONTEXT
+	swapcontext(&context_, &callerContext_);
+#else
+	quokka_fiber_switch(&sp_, callerSp_);
+#endif
+
+	// Resumed, maybe by another thread
+#ifdef QUOKKA_FIBER_ASAN
+	__sanitizer_finish_switch_fiber(asanFakeStack_, &callerStackBottom_, &callerStackSize_);
+#endif
+}
+
+void Fiber::_entry(Fiber* fiber) {
+#ifdef QUOKKA_FIBER_ASAN
+	__sanitizer_finish_switch_fiber(nullptr, &fiber->callerStackBottom_, &fiber->callerStackSize_);
+#endif
+
+	try {
+		fiber->body_();
+	}
+	catch (...) {
+		// Nothing below this frame to unwind to
+		std::terminate();
+	}
+
+	fiber->body_ = nullptr;
+	fiber->done_ = true;
+	fiber->_switchOut();
+
+	// A finished fiber is never resumed
+	std::abort();
+}
+
+#ifdef QUOKKA_FIBER_USE_UCONTEXT
+void Fiber::_ucontextEntry(unsigned int high, unsigned int low) {
+	_entry(reinterpret_cast<Fiber*>(static_cast<uintptr_t>((static_cast<uint64_t>(high) << 32) | low)));
+}
+#endif
+
+}  // namespace Quokka
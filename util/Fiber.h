@@ -0,0 +1,142 @@
+#pragma once
+
+#include <cstddef>
+#include <mutex>
+#include <vector>
+
+#include "../future/Future.h"
+
+#if !(defined(__x86_64__) && defined(__ELF__)) || defined(QUOKKA_FIBER_UCONTEXT)
+#define QUOKKA_FIBER_USE_UCONTEXT 1
+#include <ucontext.h>
+#endif
+
+namespace Quokka {
+
+/*
+* Stack of a fiber, mmapped with a PROT_NONE guard page below it,
+* so an overflow faults instead of corrupting the next stack
+*/
+struct FiberStack {
+	FiberStack() :
+		base(nullptr),
+		size(0) {
+	}
+
+	// Lowest usable address, the guard page is right below
+	void* base;
+	std::size_t size;
+};
+
+/*
+* Free fiber stacks kept for reuse, mapping a stack costs system calls
+* and page faults, a request served by a fiber should not pay for them
+*/
+class FiberStackPool {
+public:
+
+	explicit FiberStackPool(std::size_t stackSize, std::size_t maxCached = kDefaultMaxCached);
+	~FiberStackPool();
+
+	FiberStackPool(const FiberStackPool&) = delete;
+	FiberStackPool& operator=(const FiberStackPool&) = delete;
+
+	FiberStack acquire();
+	void release(FiberStack stack);
+
+	std::size_t stackSize() const;
+
+	// Shared by fibers started without a pool of their own
+	static FiberStackPool& instance();
+
+	static const std::size_t kDefaultStackSize = 256 * 1024;
+	static const std::size_t kDefaultMaxCached = 1024;
+
+private:
+
+	const std::size_t stackSize_;
+	const std::size_t maxCached_;
+
+	std::mutex mutex_;
+	std::vector<FiberStack> free_;
+};
+
+/*
+* A task with its own stack, able to suspend in the middle and resume
+* later, maybe on another thread of its scheduler
+*
+* Blocking style code runs in it without holding a worker while it
+* waits: Future::wait in a fiber parks the fiber and gives the worker
+* back, setting the value schedules the fiber again.
+*
+* Fiber::start(&pool, []() {
+*	auto user = loadUser().wait();   // the worker runs other work meanwhile
+*	...
+* });
+*
+* Switching is a handful of register moves on x86-64, ucontext elsewhere,
+* or with QUOKKA_FIBER_UCONTEXT defined.
+* Only Future::wait parks the fiber, other blocking calls, like locking
+* a mutex, still block the worker. An exception escaping f terminates the
+* process, like for std::thread.
+*/
+class Fiber final : public Suspender {
+public:
+
+	// Run f on a new fiber, scheduled on home and resumed there after each wait
+	static void start(Scheduler* home, Task f, FiberStackPool& stacks = FiberStackPool::instance());
+
+	/*
+	The task starting f on a new fiber, for whoever schedules it on home
+	A task dropped without being run frees its fiber, f is never called
+	*/
+	static Task launcher(Scheduler* home, Task f, FiberStackPool& stacks = FiberStackPool::instance());
+
+	Fiber(const Fiber&) = delete;
+	Fiber& operator=(const Fiber&) = delete;
+
+	void suspend(Function<void(Task&&)>&& arm) override;
+
+private:
+
+	Fiber(Scheduler* home, Task f, FiberStackPool& stacks);
+	~Fiber();
+
+	// Run on the calling thread until the fiber suspends or ends
+	void _run();
+	void _switchIn();
+	void _switchOut();
+
+	static void _entry(Fiber* fiber);
+#ifdef QUOKKA_FIBER_USE_UCONTEXT
+	static void _ucontextEntry(unsigned int high, unsigned int low);
+#endif
+
+	Scheduler* const home_;
+	Task body_;
+	FiberStackPool& stacks_;
+	FiberStack stack_;
+
+	// Handed to the thread by suspend, called once the fiber is off it
+	Function<void(Task&&)> arm_;
+	bool done_;
+	// CancelScope of the step running in the fiber, it's per thread otherwise
+	const StateBase* cancelScope_;
+
+#ifdef QUOKKA_FIBER_USE_UCONTEXT
+	ucontext_t context_;
+	ucontext_t callerContext_;
+#else
+	void* sp_;
+	void* callerSp_;
+#endif
+
+	// Sanitizers must be told about stack switches
+	const void* callerStackBottom_;
+	std::size_t callerStackSize_;
+	void* asanFakeStack_;
+	void* tsanFiber_;
+	void* tsanCaller_;
+};
+
+}  // namespace Quokka
@@ -0,0 +1,112 @@
+#include <algorithm>
+
+#include "Histogram.h"
+
+namespace Quokka {
+
+Histogram::Histogram() :
+	count_(0),
+	total_(0) {
+	for (int i = 0; i < kBuckets; ++i) {
+		buckets_[i] = 0;
+	}
+}
+
+Histogram::Histogram(const Histogram& other) :
+	Histogram() {
+	merge(other);
+}
+
+Histogram& Histogram::operator=(const Histogram& other) {
+	if (this != &other) {
+		for (int i = 0; i < kBuckets; ++i) {
+			buckets_[i] = 0;
+		}
+		count_ = 0;
+		total_ = 0;
+
+		merge(other);
+	}
+
+	return *this;
+}
+
+void Histogram::add(Duration d) {
+	const int64_t ns = std::max<int64_t>(0, d.count());
+
+	// Index of the highest bit of the microseconds, plus one
+	uint64_t us = static_cast<uint64_t>(ns) / 1000;
+	int i = 0;
+	while (us != 0 && i < kBuckets - 1) {
+		us >>= 1;
+		++i;
+	}
+
+	_bump(buckets_[i], 1);
+	_bump(count_, 1);
+	_bump(total_, static_cast<uint64_t>(ns));
+}
+
+void Histogram::merge(const Histogram& other) {
+	for (int i = 0; i < kBuckets; ++i) {
+		_bump(buckets_[i], other.bucket(i));
+	}
+
+	_bump(count_, other.count_.load(std::memory_order_relaxed));
+	_bump(total_, other.total_.load(std::memory_order_relaxed));
+}
+
+uint64_t Histogram::count() const {
+	return count_.load(std::memory_order_relaxed);
+}
+
+uint64_t Histogram::bucket(int i) const {
+	return buckets_[i].load(std::memory_order_relaxed);
+}
+
+Histogram::Duration Histogram::total() const {
+	return Duration(total_.load(std::memory_order_relaxed));
+}
+
+Histogram::Duration Histogram::mean() const {
+	const uint64_t n = count();
+	return n == 0 ? Duration(0) : Duration(total_.load(std::memory_order_relaxed) / n);
+}
+
+Histogram::Duration Histogram::percentile(double p) const {
+	// Buckets may be bumped while we read, count them instead of using count_
+	uint64_t counts[kBuckets];
+	uint64_t n = 0;
+	for (int i = 0; i < kBuckets; ++i) {
+		counts[i] = bucket(i);
+		n += counts[i];
+	}
+
+	if (n == 0) {
+		return Duration(0);
+	}
+
+	p = std::min(1.0, std::max(0.0, p));
+	const uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(p * n + 0.5));
+
+	uint64_t seen = 0;
+	for (int i = 0; i < kBuckets; ++i) {
+		seen += counts[i];
+		if (seen >= rank) {
+			return bucketLimit(i);
+		}
+	}
+
+	return bucketLimit(kBuckets - 1);
+}
+
+Histogram::Duration Histogram::bucketLimit(int i) {
+	return std::chrono::duration_cast<Duration>(std::chrono::microseconds(1ULL << i));
+}
+
+void Histogram::_bump(std::atomic<uint64_t>& counter, uint64_t n) {
+	// Single writer, a plain load and store is enough and avoids a locked instruction
+	counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+}  // namespace Quokka
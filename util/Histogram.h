@@ -0,0 +1,56 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+namespace Quokka {
+
+/*
+* Log2 histogram of durations
+*
+* Bucket 0 counts durations under 1us, bucket i counts [2^(i-1), 2^i) us,
+* the last bucket also counts everything longer.
+* add() is meant for one writer only, it does not use atomic read-modify-write,
+* any thread may read or copy it at the same time and sees recent counts.
+*/
+class Histogram {
+public:
+
+	using Duration = std::chrono::nanoseconds;
+
+	static const int kBuckets = 32;
+
+	Histogram();
+	Histogram(const Histogram& other);
+	Histogram& operator=(const Histogram& other);
+
+	void add(Duration d);
+	// Add other's counts to ours, not thread safe for this
+	void merge(const Histogram& other);
+
+	uint64_t count() const;
+	uint64_t bucket(int i) const;
+	Duration total() const;
+	Duration mean() const;
+
+	/*
+	* Upper bound of the bucket holding the p quantile, p in [0, 1]
+	* percentile(0.99) is a duration 99% of the samples are shorter than
+	*/
+	Duration percentile(double p) const;
+
+	// Upper bound of bucket i
+	static Duration bucketLimit(int i);
+
+private:
+
+	static void _bump(std::atomic<uint64_t>& counter, uint64_t n);
+
+	std::atomic<uint64_t> buckets_[kBuckets];
+	std::atomic<uint64_t> count_;
+	// In nanoseconds
+	std::atomic<uint64_t> total_;
+};
+
+}  // namespace Quokka
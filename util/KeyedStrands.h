@@ -0,0 +1,254 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <type_traits>
+#include <unordered_map>
+
+#include "../future/Future.h"
+
+namespace Quokka {
+
+/*
+* One strand per key, like per session or per partition, see Strand
+*
+* Tasks of the same key run one at a time in order, on any worker of the
+* executor, different keys run in parallel.
+* Keys are spread over shards, each a mutex and a map from key to its queue.
+* A key has an entry only while it has work queued or running, the last
+* task of a key removes it, so idle keys cost nothing and there is no
+* mutex or thread per key.
+*
+* The object must outlive what is scheduled on it, the destructor waits
+* until every key is idle. A key whose drain the executor drops, like a
+* pool shut down does, is dropped with its tasks, so it's idle too.
+* An exception escaping a task goes on to the executor, after the next
+* task of the key has been handed to it.
+*/
+template<typename Key, typename Hash = std::hash<Key>>
+class KeyedStrands {
+public:
+
+	/*
+	Scheduler running everything on the strand of one key, so continuations
+	keep the key's order:
+
+	auto strand = strands.strand(sessionId);
+	strands.execute(sessionId, load).then(&strand, update);
+
+	It's a key and a pointer, it must outlive the continuations using it
+	*/
+	class Handle final : public Scheduler {
+	public:
+
+		Handle(KeyedStrands* owner, const Key& key) :
+			owner_(owner),
+			key_(key) {
+		}
+
+		void schedule(Task f) override {
+			owner_->schedule(key_, std::move(f));
+		}
+
+		void schedulerLater(std::chrono::milliseconds duration, Task f) override {
+			KeyedStrands* owner = owner_;
+			owner->executor_->schedulerLater(duration, [owner, key = key_, f = std::move(f)]() mutable {
+				owner->schedule(key, std::move(f));
+			});
+		}
+
+	private:
+
+		KeyedStrands* owner_;
+		Key key_;
+	};
+
+	explicit KeyedStrands(Scheduler* executor, std::size_t shards = kDefaultShards) :
+		executor_(executor),
+		shardCount_(shards > 0 ? shards : 1),
+		shards_(new Shard[shardCount_]) {
+	}
+
+	~KeyedStrands() {
+		for (std::size_t i = 0; i < shardCount_; ++i) {
+			Shard& shard = shards_[i];
+			std::unique_lock<std::mutex> guard(shard.mutex);
+			shard.idle.wait(guard, [&shard]() {
+				return shard.queues.empty();
+			});
+		}
+	}
+
+	KeyedStrands(const KeyedStrands&) = delete;
+	KeyedStrands& operator=(const KeyedStrands&) = delete;
+
+	template<typename F, typename... Args>
+	auto execute(const Key& key, F&& f, Args&& ... args)->Future<typename std::result_of<F(Args...)>::type> {
+		using resultType = typename std::result_of<F(Args...)>::type;
+
+		Promise<resultType> promise;
+		auto future = promise.getFuture();
+
+		auto func = std::bind(std::forward<F>(f), std::forward<Args>(args)...);
+		schedule(key, [func = std::move(func), pm = std::move(promise)]() mutable {
+			pm.setWith(func);
+		});
+
+		return future;
+	}
+
+	void schedule(const Key& key, Task f) {
+		Shard& shard = _shardOf(key);
+		bool idle = false;
+		{
+			std::unique_lock<std::mutex> guard(shard.mutex);
+			auto result = shard.queues.emplace(key, std::deque<Task>());
+			result.first->second.push_back(std::move(f));
+			idle = result.second;
+		}
+
+		// The key had no entry, nobody is draining it
+		if (idle) {
+			_startDrain(&shard, key);
+		}
+	}
+
+	Handle strand(const Key& key) {
+		return Handle(this, key);
+	}
+
+	// Keys with work queued or running
+	std::size_t activeKeys() const {
+		std::size_t n = 0;
+		for (std::size_t i = 0; i < shardCount_; ++i) {
+			std::unique_lock<std::mutex> guard(shards_[i].mutex);
+			n += shards_[i].queues.size();
+		}
+
+		return n;
+	}
+
+	static const std::size_t kDefaultShards = 64;
+	// Tasks of one key run in a row before the key goes back to the executor's queue
+	static const int kMaxBatch = 32;
+
+private:
+
+	struct Shard {
+		mutable std::mutex mutex;
+		// A key is here while it has work, its running task is already popped
+		std::unordered_map<Key, std::deque<Task>, Hash> queues;
+		// Notified under mutex when queues becomes empty
+		std::condition_variable idle;
+	};
+
+	// Tells the key if the executor destroys it without running it
+	class DrainTask {
+	public:
+
+		DrainTask(KeyedStrands* owner, Shard* shard, const Key& key) :
+			owner_(owner),
+			shard_(shard),
+			key_(key) {
+		}
+
+		DrainTask(DrainTask&& rhs) noexcept :
+			owner_(rhs.owner_),
+			shard_(rhs.shard_),
+			key_(std::move(rhs.key_)) {
+			rhs.owner_ = nullptr;
+		}
+
+		~DrainTask() {
+			if (owner_) {
+				owner_->_erase(shard_, key_);
+			}
+		}
+
+		void operator()() {
+			KeyedStrands* owner = owner_;
+			owner_ = nullptr;
+			owner->_drain(shard_, key_);
+		}
+
+	private:
+
+		KeyedStrands* owner_;
+		Shard* shard_;
+		Key key_;
+	};
+
+	Shard& _shardOf(const Key& key) {
+		return shards_[hash_(key) % shardCount_];
+	}
+
+	void _startDrain(Shard* shard, const Key& key) {
+		executor_->schedule(DrainTask(this, shard, key));
+	}
+
+	void _drain(Shard* shard, const Key& key) {
+		std::exception_ptr error;
+		for (int i = 0; i < kMaxBatch && !error; ++i) {
+			Task task;
+			{
+				std::unique_lock<std::mutex> guard(shard->mutex);
+				auto it = shard->queues.find(key);
+				if (it->second.empty()) {
+					// Idle now, the next task of this key starts a new drain
+					shard->queues.erase(it);
+					if (shard->queues.empty()) {
+						shard->idle.notify_all();
+					}
+					return;
+				}
+
+				task = std::move(it->second.front());
+				it->second.pop_front();
+			}
+
+			try {
+				task();
+			}
+			catch (...) {
+				error = std::current_exception();
+			}
+		}
+
+		_startDrain(shard, key);
+		if (error) {
+			std::rethrow_exception(error);
+		}
+	}
+
+	// The drain of key was dropped, so are its tasks
+	void _erase(Shard* shard, const Key& key) {
+		std::deque<Task> dropped;
+		{
+			std::unique_lock<std::mutex> guard(shard->mutex);
+			auto it = shard->queues.find(key);
+			dropped.swap(it->second);
+			shard->queues.erase(it);
+			if (shard->queues.empty()) {
+				shard->idle.notify_all();
+			}
+		}
+	}
+
+	Scheduler* const executor_;
+	Hash hash_;
+	const std::size_t shardCount_;
+	std::unique_ptr<Shard[]> shards_;
+};
+
+template<typename Key, typename Hash>
+const std::size_t KeyedStrands<Key, Hash>::kDefaultShards;
+
+template<typename Key, typename Hash>
+const int KeyedStrands<Key, Hash>::kMaxBatch;
+
+}  // namespace Quokka
@@ -0,0 +1,126 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <utility>
+
+namespace Quokka {
+
+/*
+* Bounded lock free multi producer multi consumer queue
+*
+* A ring of cells, each with a sequence number telling whether it is free
+* for the producer of this lap or filled for the consumer of this lap.
+* Producers and consumers only race on their own position counter with
+* one CAS, they never wait for each other, a full or empty queue fails at once.
+* Capacity is rounded up to a power of two.
+*/
+template<typename T>
+class MpmcQueue {
+public:
+
+	explicit MpmcQueue(std::size_t capacity) :
+		cells_(nullptr),
+		mask_(0),
+		head_(0),
+		tail_(0) {
+		std::size_t size = 2;
+		while (size < capacity) {
+			size <<= 1;
+		}
+
+		cells_.reset(new Cell[size]);
+		mask_ = size - 1;
+		for (std::size_t i = 0; i < size; ++i) {
+			cells_[i].seq.store(i, std::memory_order_relaxed);
+		}
+	}
+
+	MpmcQueue(const MpmcQueue&) = delete;
+	MpmcQueue& operator=(const MpmcQueue&) = delete;
+
+	// Returns false if full, value is left untouched then
+	bool tryPush(T&& value) {
+		std::size_t pos = head_.load(std::memory_order_relaxed);
+		for (;;) {
+			Cell& cell = cells_[pos & mask_];
+			const std::size_t seq = cell.seq.load(std::memory_order_acquire);
+			const std::ptrdiff_t diff = static_cast<std::ptrdiff_t>(seq - pos);
+			if (diff == 0) {
+				if (head_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+					cell.value = std::move(value);
+					cell.seq.store(pos + 1, std::memory_order_release);
+					return true;
+				}
+			}
+			else if (diff < 0) {
+				// The consumer of the last lap has not taken it yet
+				return false;
+			}
+			else {
+				pos = head_.load(std::memory_order_relaxed);
+			}
+		}
+	}
+
+	// Returns false if empty
+	bool tryPop(T& value) {
+		std::size_t pos = tail_.load(std::memory_order_relaxed);
+		for (;;) {
+			Cell& cell = cells_[pos & mask_];
+			const std::size_t seq = cell.seq.load(std::memory_order_acquire);
+			const std::ptrdiff_t diff = static_cast<std::ptrdiff_t>(seq - (pos + 1));
+			if (diff == 0) {
+				if (tail_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+					value = std::move(cell.value);
+					// Free for the producer of the next lap
+					cell.seq.store(pos + mask_ + 1, std::memory_order_release);
+					return true;
+				}
+			}
+			else if (diff < 0) {
+				return false;
+			}
+			else {
+				pos = tail_.load(std::memory_order_relaxed);
+			}
+		}
+	}
+
+	std::size_t capacity() const {
+		return mask_ + 1;
+	}
+
+	// May be stale by the time it returns, claimed but not yet filled cells are counted
+	std::size_t sizeApprox() const {
+		const std::size_t tail = tail_.load(std::memory_order_acquire);
+		const std::size_t head = head_.load(std::memory_order_acquire);
+		return head > tail ? head - tail : 0;
+	}
+
+	bool empty() const {
+		return sizeApprox() == 0;
+	}
+
+private:
+
+	struct Cell {
+		std::atomic<std::size_t> seq;
+		T value;
+	};
+
+	static const std::size_t kCacheLine = 64;
+
+	std::unique_ptr<Cell[]> cells_;
+	std::size_t mask_;
+
+	// Producers and consumers spin on different cache lines
+	char pad0_[kCacheLine];
+	std::atomic<std::size_t> head_;
+	char pad1_[kCacheLine - sizeof(std::atomic<std::size_t>)];
+	std::atomic<std::size_t> tail_;
+	char pad2_[kCacheLine - sizeof(std::atomic<std::size_t>)];
+};
+
+}  // namespace Quokka
@@ -0,0 +1,179 @@
+#include <exception>
+#include <thread>
+
+#include "Strand.h"
+
+namespace Quokka {
+
+Strand::Strand(Scheduler* executor) :
+	executor_(executor),
+	pending_(0),
+	tail_(&stub_),
+	head_(&stub_) {
+}
+
+Strand::~Strand() {
+	// A drain may still be queued on the executor, it refers to us
+	std::unique_lock<std::mutex> guard(idleMutex_);
+	idleCond_.wait(guard, [this]() {
+		return pending_.load(std::memory_order_acquire) == 0;
+	});
+}
+
+void Strand::schedule(Task f) {
+	_push(new Node(std::move(f)));
+
+	// Only the one who finds us idle starts draining
+	if (pending_.fetch_add(1, std::memory_order_acq_rel) == 0) {
+		_scheduleDrain();
+	}
+}
+
+void Strand::schedulerLater(std::chrono::milliseconds duration, Task f) {
+	executor_->schedulerLater(duration, [this, f = std::move(f)]() mutable {
+		schedule(std::move(f));
+	});
+}
+
+std::size_t Strand::pending() const {
+	return pending_.load(std::memory_order_relaxed);
+}
+
+void Strand::_push(Node* node) {
+	node->next.store(nullptr, std::memory_order_relaxed);
+	Node* prev = tail_.exchange(node, std::memory_order_acq_rel);
+	// Between the exchange and this store, the consumer can't see node yet
+	prev->next.store(node, std::memory_order_release);
+}
+
+Strand::Node* Strand::_pop() {
+	Node* head = head_;
+	Node* next = head->next.load(std::memory_order_acquire);
+
+	if (head == &stub_) {
+		if (next == nullptr) {
+			return nullptr;
+		}
+
+		head_ = next;
+		head = next;
+		next = next->next.load(std::memory_order_acquire);
+	}
+
+	if (next != nullptr) {
+		head_ = next;
+		return head;
+	}
+
+	if (head != tail_.load(std::memory_order_acquire)) {
+		return nullptr;
+	}
+
+	// head is the last node, put the stub behind it so it can be taken
+	_push(&stub_);
+
+	next = head->next.load(std::memory_order_acquire);
+	if (next != nullptr) {
+		head_ = next;
+		return head;
+	}
+
+	return nullptr;
+}
+
+void Strand::_scheduleDrain() {
+	// Tells the strand if the executor destroys it without running it
+	struct DrainTask {
+		explicit DrainTask(Strand* s) :
+			strand(s) {
+		}
+
+		DrainTask(DrainTask&& rhs) noexcept :
+			strand(rhs.strand) {
+			rhs.strand = nullptr;
+		}
+
+		~DrainTask() {
+			if (strand) {
+				strand->_dropped();
+			}
+		}
+
+		void operator()() {
+			Strand* s = strand;
+			strand = nullptr;
+			s->_drain();
+		}
+
+		Strand* strand;
+	};
+
+	executor_->schedule(DrainTask(this));
+}
+
+void Strand::_drain() {
+	std::exception_ptr error;
+	for (int i = 0; i < kMaxBatch && !error; ++i) {
+		Node* node = nullptr;
+		// pending_ says it's there, its producer is just finishing _push
+		while ((node = _pop()) == nullptr) {
+			std::this_thread::yield();
+		}
+
+		try {
+			node->task();
+		}
+		catch (...) {
+			error = std::current_exception();
+		}
+		delete node;
+
+		if (_finishOne()) {
+			if (error) {
+				std::rethrow_exception(error);
+			}
+			return;
+		}
+	}
+
+	// Still busy, give other work on the executor a turn
+	_scheduleDrain();
+	if (error) {
+		std::rethrow_exception(error);
+	}
+}
+
+void Strand::_dropped() {
+	for (;;) {
+		Node* node = nullptr;
+		while ((node = _pop()) == nullptr) {
+			std::this_thread::yield();
+		}
+
+		delete node;
+		if (_finishOne()) {
+			return;
+		}
+	}
+}
+
+bool Strand::_finishOne() {
+	/*
+	Only the drain takes pending_ down, so only 1 can become 0. That one is
+	taken under idleMutex_, the destructor may return right after it
+	*/
+	if (pending_.load(std::memory_order_acquire) != 1) {
+		pending_.fetch_sub(1, std::memory_order_acq_rel);
+		return false;
+	}
+
+	std::unique_lock<std::mutex> guard(idleMutex_);
+	if (pending_.fetch_sub(1, std::memory_order_acq_rel) != 1) {
+		return false;
+	}
+
+	idleCond_.notify_all();
+	return true;
+}
+
+}  // namespace Quokka
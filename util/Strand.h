@@ -0,0 +1,115 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <type_traits>
+
+#include "../future/Future.h"
+
+namespace Quokka {
+
+/*
+* Serial executor on top of another Scheduler, usually a ThreadPool
+*
+* Tasks run one at a time in the order they were scheduled, each on
+* whatever worker picks the strand up, never two at once. So data touched
+* only from one strand needs no lock:
+*
+* Strand strand(&pool);
+* strand.execute(updateSession, request).then(&strand, reply);
+*
+* Scheduling is lock free, producers append to an intrusive queue with one
+* exchange, and only the first one to find the strand idle hands it to
+* the executor. An idle strand holds no task and no heap memory.
+* After kMaxBatch tasks in a row the strand goes back to the executor's queue,
+* so a busy strand does not keep a worker to itself.
+*
+* The strand must outlive what is scheduled on it, the destructor waits
+* until it's idle, so never destroy a strand from one of its own tasks.
+* If the executor drops the strand's drain, like a pool shut down does,
+* the queued tasks are dropped too, so the destructor doesn't wait forever.
+*
+* An exception escaping a task goes on to the executor, after the next
+* task has been handed to it.
+*/
+class Strand final : public Scheduler {
+public:
+
+	explicit Strand(Scheduler* executor);
+	~Strand();
+
+	Strand(const Strand&) = delete;
+	Strand& operator=(const Strand&) = delete;
+
+	template<typename F, typename... Args>
+	auto execute(F&& f, Args&& ... args)->Future<typename std::result_of<F(Args...)>::type>;
+
+	void schedule(Task f) override;
+	// Waits duration on the executor's timers, then it's queued like schedule
+	void schedulerLater(std::chrono::milliseconds duration, Task f) override;
+
+	// Tasks scheduled but not done yet
+	std::size_t pending() const;
+
+	static const int kMaxBatch = 32;
+
+private:
+
+	struct Node {
+		Node() :
+			next(nullptr) {
+		}
+
+		explicit Node(Task&& t) :
+			task(std::move(t)),
+			next(nullptr) {
+		}
+
+		Task task;
+		std::atomic<Node*> next;
+	};
+
+	void _push(Node* node);
+	// nullptr if empty or the next node is being pushed right now
+	Node* _pop();
+	// Hand _drain to the executor
+	void _scheduleDrain();
+	void _drain();
+	// The executor dropped a drain without running it, drop the tasks as well
+	void _dropped();
+	// A task is done, returns true if it was the last one
+	bool _finishOne();
+
+	Scheduler* const executor_;
+
+	std::atomic<std::size_t> pending_;
+	// Producers append at tail_, the one draining consumer pops at head_
+	std::atomic<Node*> tail_;
+	Node* head_;
+	// Keeps the queue never empty, so producers and consumer do not race on one node
+	Node stub_;
+
+	// The destructor waits on these until pending_ is 0
+	std::mutex idleMutex_;
+	std::condition_variable idleCond_;
+};
+
+template<typename F, typename... Args>
+auto Strand::execute(F&& f, Args&& ... args) -> Future<typename std::result_of<F(Args...)>::type> {
+	using resultType = typename std::result_of<F(Args...)>::type;
+
+	Promise<resultType> promise;
+	auto future = promise.getFuture();
+
+	auto func = std::bind(std::forward<F>(f), std::forward<Args>(args)...);
+	schedule([func = std::move(func), pm = std::move(promise)]() mutable {
+		pm.setWith(func);
+	});
+
+	return future;
+}
+
+}  // namespace Quokka
@@ -0,0 +1,121 @@
+#include <algorithm>
+
+#include "TaskQueue.h"
+
+namespace Quokka {
+
+TaskQueue::TaskQueue() :
+	seq_(0),
+	size_(0) {
+	for (int i = 0; i < kLanes; ++i) {
+		skipped_[i] = 0;
+	}
+}
+
+void TaskQueue::push(QueuedTask&& task, TaskPriority priority) {
+	lanes_[static_cast<int>(priority)].push_back(std::move(task));
+	++size_;
+}
+
+void TaskQueue::pushBefore(QueuedTask&& task, const TimePoint& deadline) {
+	deadlines_.push_back(DeadlineTask{ deadline, seq_++, std::move(task) });
+	std::push_heap(deadlines_.begin(), deadlines_.end(), &TaskQueue::_later);
+	++size_;
+}
+
+bool TaskQueue::pop(QueuedTask& task) {
+	if (size_ == 0) {
+		return false;
+	}
+
+	const int lane = _pickLane();
+	if (lane < 0) {
+		std::pop_heap(deadlines_.begin(), deadlines_.end(), &TaskQueue::_later);
+		task = std::move(deadlines_.back().task);
+		deadlines_.pop_back();
+	}
+	else {
+		task = std::move(lanes_[lane].front());
+		lanes_[lane].pop_front();
+	}
+
+	--size_;
+	return true;
+}
+
+std::size_t TaskQueue::popBatch(std::deque<QueuedTask>& out, std::size_t max) {
+	const int normal = static_cast<int>(TaskPriority::Normal);
+	const int low = static_cast<int>(TaskPriority::Low);
+	if (hasUrgent() || !lanes_[low].empty()) {
+		return 0;
+	}
+
+	auto& lane = lanes_[normal];
+	const std::size_t n = std::min(max, lane.size());
+	for (std::size_t i = 0; i < n; ++i) {
+		out.push_back(std::move(lane.front()));
+		lane.pop_front();
+	}
+
+	size_ -= n;
+	return n;
+}
+
+std::size_t TaskQueue::size() const {
+	return size_;
+}
+
+bool TaskQueue::empty() const {
+	return size_ == 0;
+}
+
+bool TaskQueue::hasUrgent() const {
+	return !deadlines_.empty() || !lanes_[static_cast<int>(TaskPriority::High)].empty();
+}
+
+bool TaskQueue::_later(const DeadlineTask& a, const DeadlineTask& b) {
+	if (a.deadline != b.deadline) {
+		return a.deadline > b.deadline;
+	}
+
+	return a.seq > b.seq;
+}
+
+int TaskQueue::_pickLane() {
+	// A starving lane goes first, the lowest one first. High starves only
+	// behind deadline tasks, so it's checked too
+	for (int i = kLanes - 1; i >= 0; --i) {
+		if (skipped_[i] >= kMaxSkips && !lanes_[i].empty()) {
+			skipped_[i] = 0;
+			return i;
+		}
+	}
+
+	int lane = kLanes;
+	if (!deadlines_.empty()) {
+		lane = -1;
+	}
+	else {
+		for (int i = 0; i < kLanes; ++i) {
+			if (!lanes_[i].empty()) {
+				lane = i;
+				break;
+			}
+		}
+	}
+
+	// Every lower lane with work is passed over this time
+	for (int i = std::max(lane + 1, 0); i < kLanes; ++i) {
+		if (!lanes_[i].empty()) {
+			++skipped_[i];
+		}
+	}
+
+	if (lane >= 0 && lane < kLanes) {
+		skipped_[lane] = 0;
+	}
+
+	return lane;
+}
+
+}  // namespace Quokka
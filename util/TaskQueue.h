@@ -0,0 +1,105 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <vector>
+
+#include "../future/Function.h"
+
+namespace Quokka {
+
+enum class TaskPriority {
+	High,
+	Normal,
+	Low
+};
+
+/*
+* A task waiting in a queue and when it was queued,
+* so ThreadPool can tell how long it waited, and who to bill for it
+*/
+struct QueuedTask {
+	using TimePoint = std::chrono::steady_clock::time_point;
+
+	QueuedTask() :
+		tag(0) {
+	}
+
+	QueuedTask(Task&& t, const TimePoint& when, unsigned id = 0) :
+		task(std::move(t)),
+		queued(when),
+		tag(id) {
+	}
+
+	explicit operator bool() const {
+		return static_cast<bool>(task);
+	}
+
+	Task task;
+	TimePoint queued;
+	// Accounting tag, 0 if untagged
+	unsigned tag;
+};
+
+/*
+* The global queue of ThreadPool, not thread safe
+*
+* Tasks with a deadline are served first, earliest deadline first,
+* then High, Normal and Low priority tasks, each lane is FIFO.
+* To keep lower lanes making progress, once a lane has been passed over
+* kMaxSkips times while it had work, its oldest task is served next.
+*/
+class TaskQueue {
+public:
+
+	using TimePoint = std::chrono::steady_clock::time_point;
+
+	TaskQueue();
+
+	void push(QueuedTask&& task, TaskPriority priority = TaskPriority::Normal);
+	void pushBefore(QueuedTask&& task, const TimePoint& deadline);
+
+	bool pop(QueuedTask& task);
+
+	/*
+	* Pop up to max Normal tasks into out, only if nothing more urgent
+	* or starving is waiting, used to move work to a worker's own deque
+	*/
+	std::size_t popBatch(std::deque<QueuedTask>& out, std::size_t max);
+
+	std::size_t size() const;
+	bool empty() const;
+
+	// There are deadline or High priority tasks
+	bool hasUrgent() const;
+
+	static const int kMaxSkips = 16;
+
+private:
+
+	struct DeadlineTask {
+		TimePoint deadline;
+		// Keep FIFO order between same deadlines
+		uint64_t seq;
+		QueuedTask task;
+	};
+
+	// For std::push_heap and std::pop_heap, earliest deadline on top
+	static bool _later(const DeadlineTask& a, const DeadlineTask& b);
+
+	// Lane to pop from, -1 for deadline heap
+	int _pickLane();
+
+	std::vector<DeadlineTask> deadlines_;
+	uint64_t seq_;
+
+	static const int kLanes = 3;
+	std::deque<QueuedTask> lanes_[kLanes];
+	// How many times each lane was passed over while it had work
+	int skipped_[kLanes];
+
+	std::size_t size_;
+};
+
+}  // namespace Quokka
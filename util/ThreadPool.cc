@@ -1,33 +1,142 @@
 ﻿#include <algorithm>
 #include <cassert>
 
+#ifdef __linux__
+#include <time.h>
+#endif
+
 #include "ThreadPool.h"
 
 namespace Quokka {
 
+namespace {
+
+// For counters with a single writer, no locked instruction needed
+void bumpCounter(std::atomic<uint64_t>& counter, uint64_t n) {
+	counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+// Cpu time used by the calling thread, in nanoseconds
+uint64_t threadCpuTime() {
+#ifdef __linux__
+	timespec ts;
+	if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) == 0) {
+		return static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + static_cast<uint64_t>(ts.tv_nsec);
+	}
+#endif
+	return 0;
+}
+
+}  // end namespace
+
+const unsigned ThreadPool::kMaxTags;
+
 thread_local bool ThreadPool::working_ = true;
+thread_local ThreadPool::Worker* ThreadPool::current_ = nullptr;
 std::thread::id ThreadPool::s_mainThread;
+constexpr std::chrono::milliseconds ThreadPool::kDefaultMaxIdleTime;
+constexpr std::chrono::milliseconds ThreadPool::kFullWaitSlice;
+
+ThreadPool::ThreadPool(Mode mode)
+	: ThreadPool(mode, false, 0, Overflow::Block) {
+	_startBlockingLane();
+}
+
+ThreadPool::ThreadPool(unsigned int threads, Affinity affinity)
+	: ThreadPool(Mode::WorkStealing, true, 0, Overflow::Block) {
+	_startBlockingLane();
+
+	std::vector<CpuInfo> order;
+	if (affinity == Affinity::PinToCores || threads == 0) {
+		const auto topology = CpuTopology::detect();
+		order = topology.placementOrder();
+		nodeWorkers_.resize(topology.nodeCount());
+	}
+
+	if (threads == 0) {
+		threads = static_cast<unsigned>(std::max<std::size_t>(1, order.size()));
+	}
+	threads = std::min<unsigned>(threads, kMaxThreads);
+
+	maxThreads_ = threads;
+	maxIdleThreads_ = threads;
 
-ThreadPool::ThreadPool()
-	: currentThreads_(0),
+	std::unique_lock<std::mutex> guard(mutex_);
+	for (unsigned i = 0; i < threads; ++i) {
+		if (affinity == Affinity::PinToCores && !order.empty()) {
+			// More workers than cpus, wrap around
+			const CpuInfo& info = order[i % order.size()];
+			_spawnWorker(info.cpu, info.node);
+
+			Worker* worker = workers_[workerCount_ - 1];
+			cpuWorkers_.insert(std::make_pair(info.cpu, worker));
+			nodeWorkers_[info.node].push_back(worker);
+		}
+		else {
+			_spawnWorker();
+		}
+	}
+}
+
+ThreadPool::ThreadPool(Mode mode, std::size_t queueCapacity, Overflow whenFull)
+	: ThreadPool(mode, false, queueCapacity, whenFull) {
+	_startBlockingLane();
+}
+
+ThreadPool::ThreadPool(Mode mode, bool fixed, std::size_t queueCapacity, Overflow whenFull)
+	: mode_(mode),
+	fixed_(fixed),
+	overflow_(whenFull),
+	currentThreads_(0),
+	workers_(new std::atomic<Worker*>[kMaxThreads]),
+	workerCount_(0),
+	nextNodeWorker_(0),
 	waiters_(0),
-	shutdown_(false) {
+	slotSpawn_(false),
+	shutdown_(false),
+	queueSize_(0),
+	urgent_(false),
+	ring_(queueCapacity > 0 ? new MpmcQueue<QueuedTask>(queueCapacity) : nullptr),
+	blockedProducers_(0),
+	created_(std::chrono::steady_clock::now()),
+	submitted_(0),
+	rejected_(0),
+	admissionTarget_(0),
+	admissionInterval_(0),
+	aboveTargetSince_(0),
+	shedding_(false),
+	shed_(0),
+	lockContended_(0),
+	lockWait_(0),
+	spawned_(0),
+	retired_(0),
+	timerShutdown_(false) {
+
+	for (int i = 0; i < kMaxThreads; ++i) {
+		workers_[i] = nullptr;
+	}
 
 	// Returns the number of concurrent threads supported by the implementation
 	maxIdleThreads_ = std::max(1U, std::thread::hardware_concurrency());
 	maxThreads_ = kMaxThreads;
-	pendingStopSignal_ = 0;
+	maxIdleTime_ = kDefaultMaxIdleTime.count();
 
 	// Init main thread id
 	s_mainThread = std::this_thread::get_id();
+}
 
-	monitor_ = std::thread([this]() {
-		_monitorRoutine();
-	});
+void ThreadPool::_startBlockingLane() {
+	// No thread is started until the first blocking task
+	blocking_.reset(new ThreadPool(Mode::Shared, false, 0, Overflow::Block));
+	blocking_->setMaxThreads(kDefaultMaxBlockingThreads);
 }
 
 ThreadPool::~ThreadPool() {
 	joinAll();
+
+	for (unsigned i = 0; i < workerCount_; ++i) {
+		delete workers_[i].load();
+	}
 }
 
 void ThreadPool::joinAll() {
@@ -35,7 +144,17 @@ void ThreadPool::joinAll() {
 		return;
 	}
 
-	decltype(workers_) tmp;
+	{
+		std::unique_lock<std::mutex> guard(timerMutex_);
+		timerShutdown_ = true;
+		timerCond_.notify_one();
+	}
+
+	if (timerThread_.joinable()) {
+		timerThread_.join();
+	}
+
+	std::vector<std::thread> tmp;
 
 	{
 		std::unique_lock<std::mutex> guard(mutex_);
@@ -46,7 +165,14 @@ void ThreadPool::joinAll() {
 		shutdown_ = true;
 		cond_.notify_all();
 
-		tmp.swap(workers_);
+		for (unsigned i = 0; i < workerCount_; ++i) {
+			tmp.push_back(std::move(workers_[i].load()->thread));
+		}
+	}
+
+	{
+		std::unique_lock<std::mutex> guard(spaceMutex_);
+		spaceCond_.notify_all();
 	}
 
 	for (auto& t : tmp) {
@@ -55,109 +181,1033 @@ void ThreadPool::joinAll() {
 		}
 	}
 
-	if (monitor_.joinable()) {
-		monitor_.join();
+	// Pushed to the ring by a producer racing with shutdown, after workers left
+	QueuedTask task;
+	while (_popRing(task)) {
+		task.task();
+	}
+
+	// After our workers, they may still be waiting for blocking work
+	if (blocking_) {
+		blocking_->joinAll();
 	}
 }
 
 void ThreadPool::setMaxIdleThreads(unsigned int m) {
-	if (0 < m && m <= kMaxThreads) {
+	if (!fixed_ && 0 < m && m <= kMaxThreads) {
 		maxIdleThreads_ = m;
 	}
 }
 
 void ThreadPool::setMaxThreads(unsigned int m) {
-	if (0 < m && m <= kMaxThreads) {
+	if (!fixed_ && 0 < m && m <= kMaxThreads) {
 		maxThreads_ = m;
 	}
 }
 
-void ThreadPool::_monitorRoutine() {
-	while (!shutdown_) {
-		// Do NOT use mutex and cond, otherwise `Execute` will awake me
-		std::this_thread::sleep_for(std::chrono::milliseconds(300));
+Scheduler* ThreadPool::blockingScheduler() {
+	return blocking_.get();
+}
 
-		std::unique_lock<std::mutex> guard(mutex_);
+void ThreadPool::setMaxBlockingThreads(unsigned int m) {
+	blocking_->setMaxThreads(m);
+}
+
+void ThreadPool::setMaxIdleBlockingThreads(unsigned int m) {
+	blocking_->setMaxIdleThreads(m);
+}
+
+std::vector<ThreadPool::TagUsage> ThreadPool::tagUsage() const {
+	std::vector<TagUsage> usage(kMaxTags);
+	for (unsigned tag = 0; tag < kMaxTags; ++tag) {
+		usage[tag].tag = tag;
+		usage[tag].tasks = 0;
+		usage[tag].cpuTime = std::chrono::nanoseconds(0);
+		usage[tag].wallTime = std::chrono::nanoseconds(0);
+	}
+
+	const unsigned n = workerCount_;
+	for (unsigned i = 0; i < n; ++i) {
+		const TagCounters* tags = workers_[i].load()->stats.tags.load(std::memory_order_acquire);
+		if (tags == nullptr) {
+			continue;
+		}
+
+		for (unsigned tag = 0; tag < kMaxTags; ++tag) {
+			usage[tag].tasks += tags[tag].tasks.load(std::memory_order_relaxed);
+			usage[tag].cpuTime += std::chrono::nanoseconds(tags[tag].cpuTime.load(std::memory_order_relaxed));
+			usage[tag].wallTime += std::chrono::nanoseconds(tags[tag].wallTime.load(std::memory_order_relaxed));
+		}
+	}
+
+	usage.erase(std::remove_if(usage.begin(), usage.end(), [](const TagUsage& u) {
+		return u.tasks == 0;
+	}), usage.end());
+
+	return usage;
+}
+
+ThreadPool::Stats ThreadPool::blockingStats() const {
+	return blocking_->stats();
+}
+
+void ThreadPool::setAdmissionControl(std::chrono::microseconds target, std::chrono::microseconds interval) {
+	using std::chrono::nanoseconds;
+
+	admissionInterval_ = std::chrono::duration_cast<nanoseconds>(interval).count();
+	admissionTarget_ = std::max<long long>(0, std::chrono::duration_cast<nanoseconds>(target).count());
+	_stopShedding();
+}
+
+double ThreadPool::Stats::enqueueRate() const {
+	const double seconds = std::chrono::duration<double>(uptime).count();
+	return seconds > 0 ? submitted / seconds : 0;
+}
+
+ThreadPool::Stats ThreadPool::stats() const {
+	Stats result;
+	result.uptime = std::chrono::steady_clock::now() - created_;
+	result.submitted = submitted_.load(std::memory_order_relaxed);
+	result.rejected = rejected_.load(std::memory_order_relaxed);
+	result.shed = shed_.load(std::memory_order_relaxed);
+	result.overloaded = shedding_.load(std::memory_order_relaxed);
+	result.lockContended = lockContended_.load(std::memory_order_relaxed);
+	uint64_t lockWait = lockWait_.load(std::memory_order_relaxed);
+	result.localQueueDepth = 0;
+
+	const unsigned n = workerCount_;
+	for (unsigned i = 0; i < n; ++i) {
+		Worker* w = workers_[i];
+		const WorkerStats& ws = w->stats;
+
+		result.submitted += ws.submitted.load(std::memory_order_relaxed);
+		result.lockContended += ws.lockContended.load(std::memory_order_relaxed);
+		lockWait += ws.lockWait.load(std::memory_order_relaxed);
+		result.queueTime.merge(ws.queueTime);
+		result.runTime.merge(ws.runTime);
+
+		std::unique_lock<std::mutex> guard(w->mutex);
+		result.localQueueDepth += w->tasks.size() + (w->next ? 1 : 0);
+	}
+
+	result.executed = result.runTime.count();
+	result.lockWait = std::chrono::nanoseconds(lockWait);
+
+	std::unique_lock<std::mutex> guard(mutex_);
+	result.globalQueueDepth = tasks_.size() + (ring_ ? ring_->sizeApprox() : 0);
+	result.threads = currentThreads_;
+	result.idleThreads = waiters_;
+	result.spawned = spawned_;
+	result.retired = retired_;
+
+	return result;
+}
+
+void ThreadPool::schedule(Task f) {
+	// Continuations must neither wait for room nor get lost
+	TaskOptions options;
+	options.onFull = OnFull::Spill;
+	_submit(std::move(f), options);
+}
+
+void ThreadPool::schedulerLater(std::chrono::milliseconds duration, Task f) {
+	std::unique_lock<std::mutex> guard(timerMutex_);
+	if (timerShutdown_) {
+		return;
+	}
+
+	if (!timerThread_.joinable()) {
+		timerThread_ = std::thread([this]() {
+			_timerRoutine();
+		});
+	}
+
+	// Timer thread only hands it to workers, never runs f itself
+	timers_.scheduleAfter(duration, [this, f = std::move(f)]() mutable {
+		schedule(std::move(f));
+	});
+
+	// It may be earlier than what the timer thread is waiting for
+	timerCond_.notify_one();
+}
+
+bool ThreadPool::runPendingTask() {
+	Worker* self = current_;
+	if (self == nullptr || self->pool != this) {
+		return false;
+	}
+
+	QueuedTask task;
+	if (!_tryNextTask(self, task)) {
+		return false;
+	}
+
+	_runTask(self, task);
+	return true;
+}
+
+void ThreadPool::_timerRoutine() {
+	std::unique_lock<std::mutex> guard(timerMutex_);
+	while (!timerShutdown_) {
+		timers_.update();
+
+		const auto wait = timers_.nearestTimer();
+		if (wait == std::chrono::milliseconds::max()) {
+			timerCond_.wait(guard);
+		}
+		else if (wait != std::chrono::milliseconds::min()) {
+			// Less than 1ms left is rounded to 0, don't spin for it
+			timerCond_.wait_for(guard, std::max(wait, std::chrono::milliseconds(1)));
+		}
+	}
+}
+
+void ThreadPool::setMaxIdleTime(std::chrono::milliseconds t) {
+	if (t.count() > 0) {
+		maxIdleTime_ = t.count();
+	}
+}
+
+ThreadPool::Submitted ThreadPool::_submit(Task&& f, const TaskOptions& options) {
+	if (_shouldShed(options)) {
+		shed_.fetch_add(1, std::memory_order_relaxed);
+		return Submitted::Overloaded;
+	}
+
+	_countSubmitted(1);
+	QueuedTask task(std::move(f), std::chrono::steady_clock::now(), options.tag);
+
+	if (options.ordered()) {
+		auto guard = _lockQueue();
 		if (shutdown_) {
-			return;
+			return Submitted::Shutdown;
+		}
+
+		if (options.deadline != TimePoint::max()) {
+			tasks_.pushBefore(std::move(task), options.deadline);
+		}
+		else {
+			tasks_.push(std::move(task), options.priority);
+		}
+		_queueChanged();
+
+		if (waiters_ == 0 && currentThreads_ < maxThreads_) {
+			_spawnWorker();
+		}
+
+		cond_.notify_one();
+		return Submitted::Queued;
+	}
+
+	if (options.where.kind != Locality::Kind::Any) {
+		Worker* target = _localityWorker(options.where);
+		if (target && _pushTo(target, task)) {
+			_wakeWorker(target);
+			return Submitted::Queued;
+		}
+	}
+
+	Worker* self = current_;
+	if (ring_ && options.onFull != OnFull::Spill && !(self && self->pool == this)) {
+		// Plain work from outside, no global lock unless someone must be woken
+		if (shutdown_) {
+			return Submitted::Shutdown;
+		}
+
+		const bool block = (options.onFull == OnFull::Default && overflow_ == Overflow::Block);
+		if (!_pushRing(task, block)) {
+			if (shutdown_) {
+				return Submitted::Shutdown;
+			}
+
+			rejected_.fetch_add(1, std::memory_order_relaxed);
+			return Submitted::Full;
+		}
+
+		_wakeIdle();
+		return Submitted::Queued;
+	}
+
+	if (self && self->pool == this) {
+		/*
+		Submitted by one of our workers, it runs next on this worker without
+		global lock. The follow-up it replaces goes to our deque in WorkStealing
+		mode, or to the global queue. An idle worker is woken all the same, the
+		running task may go on for long, or even wait for this one, so the slot
+		is stolen rather than left waiting for us
+		*/
+		{
+			std::unique_lock<std::mutex> guard(self->mutex);
+			std::swap(self->next, task);
+			if (!task) {
+				guard.unlock();
+				_wakeForSlot();
+				return Submitted::Queued;
+			}
+
+			if (mode_ == Mode::WorkStealing) {
+				self->tasks.push_back(std::move(task));
+			}
 		}
 
-		// 首先将nw设置为正在等待的线程的数量
-		auto nw = waiters_;
+		if (mode_ == Mode::WorkStealing) {
+			_wakeIdle();
+			return Submitted::Queued;
+		}
+	}
 
-		// If there is any pending stop signal to consume waiters
-		nw -= pendingStopSignal_;
+	auto guard = _lockQueue();
+	if (shutdown_) {
+		return Submitted::Shutdown;
+	}
 
-		while (nw-- > maxIdleThreads_) {
-			tasks_.push_back([this]() {
-				this->working_ = false;
-			});
-			cond_.notify_one();
-			++pendingStopSignal_;
+	tasks_.push(std::move(task));
+	_queueChanged();
+	if (waiters_ == 0 && currentThreads_ < maxThreads_) {
+		_spawnWorker();
+	}
+
+	cond_.notify_one();
+
+	return Submitted::Queued;
+}
+
+bool ThreadPool::_pushRing(QueuedTask& task, bool block) {
+	if (ring_->tryPush(std::move(task))) {
+		return true;
+	}
+
+	if (!block) {
+		return false;
+	}
+
+	std::unique_lock<std::mutex> guard(spaceMutex_);
+	++blockedProducers_;
+	bool pushed = false;
+	while (!shutdown_) {
+		// After counting ourselves, so a consumer either sees us or we see its room
+		if (ring_->tryPush(std::move(task))) {
+			pushed = true;
+			break;
 		}
+
+		// Bounded sleep, in case all workers are parked while the ring fills up
+		spaceCond_.wait_for(guard, kFullWaitSlice);
 	}
+	--blockedProducers_;
+
+	return pushed;
 }
 
-void ThreadPool::_workerRoutine() {
-	// working_是一个thread_local的变量，表明每个thread都有一个自己的副本
-	working_ = true;
+bool ThreadPool::_popRing(QueuedTask& task) {
+	if (!ring_ || !ring_->tryPop(task)) {
+		return false;
+	}
 
-	while (working_) {
-		std::function<void()> task;
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (blockedProducers_ > 0) {
+		std::unique_lock<std::mutex> guard(spaceMutex_);
+		spaceCond_.notify_one();
+	}
+
+	return true;
+}
+
+bool ThreadPool::_ringEmpty() const {
+	return !ring_ || ring_->empty();
+}
 
+ThreadPool::Submitted ThreadPool::_submitBatch(std::vector<Task>&& tasks) {
+	if (_shouldShed(TaskOptions())) {
+		shed_.fetch_add(tasks.size(), std::memory_order_relaxed);
+		return Submitted::Overloaded;
+	}
+
+	_countSubmitted(tasks.size());
+	const auto now = std::chrono::steady_clock::now();
+
+	Worker* self = current_;
+	if (mode_ == Mode::WorkStealing && self && self->pool == this) {
 		{
+			std::unique_lock<std::mutex> guard(self->mutex);
+			for (auto& task : tasks) {
+				self->tasks.push_back(QueuedTask(std::move(task), now));
+			}
+		}
+
+		// Idle workers will steal the rest from us
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (waiters_ > 0) {
 			std::unique_lock<std::mutex> guard(mutex_);
+			cond_.notify_all();
+		}
+		else {
+			_wakeIdle();
+		}
+
+		return Submitted::Queued;
+	}
+
+	if (ring_ && !(self && self->pool == this)) {
+		{
+			auto guard = _lockQueue();
+			if (shutdown_) {
+				return Submitted::Shutdown;
+			}
+			_spawnForBatch(tasks.size());
+		}
+
+		// One at a time, waiting for room, workers are woken as we go so they drain it
+		for (auto& task : tasks) {
+			QueuedTask queued(std::move(task), now);
+			if (shutdown_ || !_pushRing(queued, true)) {
+				return Submitted::Shutdown;
+			}
+
+			_notifyIdle();
+		}
+
+		return Submitted::Queued;
+	}
+
+	auto guard = _lockQueue();
+	if (shutdown_) {
+		return Submitted::Shutdown;
+	}
 
-			++waiters_;
-			/*
-			wait causes the current thread to block until the condition variable
-			is notified or a spurious wakeup occurs,
-			optionally looping until some predicate is satisfied
-			这里给wait传了第二个参数，是一个谓词，returns false if the waiting should
-			be continued
-
-			当shutdown_了或者tasks_不为空的话(表明已经有task可以做了)停止等待
-			并且将waiter的数量-1
-			*/
-			cond_.wait(guard, [this]() {
-				return shutdown_ || !tasks_.empty();
-			});
+	for (auto& task : tasks) {
+		tasks_.push(QueuedTask(std::move(task), now));
+	}
+	_queueChanged();
+
+	_spawnForBatch(tasks.size());
+	cond_.notify_all();
+
+	return Submitted::Queued;
+}
+
+void ThreadPool::_spawnForBatch(std::size_t n) {
+	if (n <= waiters_) {
+		return;
+	}
+
+	/*
+	Not a thread per task: up to a thread per core, the idle ones and the
+	new ones share the batch. One at least if none is idle, like execute
+	*/
+	const unsigned cores = std::max(1U, std::thread::hardware_concurrency());
+	std::size_t wanted = std::min<std::size_t>(n - waiters_, cores > currentThreads_ ? cores - currentThreads_ : 0);
+	if (wanted == 0 && waiters_ == 0) {
+		wanted = 1;
+	}
+
+	while (wanted-- > 0 && currentThreads_ < maxThreads_) {
+		_spawnWorker();
+	}
+}
+
+ThreadPool::Worker* ThreadPool::_localityWorker(const Locality& where) {
+	if (where.kind == Locality::Kind::Core) {
+		auto it = cpuWorkers_.find(where.index);
+		return it == cpuWorkers_.end() ? nullptr : it->second;
+	}
+
+	if (where.kind == Locality::Kind::Node &&
+		0 <= where.index && where.index < static_cast<int>(nodeWorkers_.size())) {
+		const auto& workers = nodeWorkers_[where.index];
+		if (!workers.empty()) {
+			// Round robin over workers of the node
+			return workers[nextNodeWorker_++ % workers.size()];
+		}
+	}
+
+	return nullptr;
+}
+
+bool ThreadPool::_pushTo(Worker* worker, QueuedTask& task) {
+	std::unique_lock<std::mutex> guard(worker->mutex);
+	// The worker has left for shutdown, nobody would run it
+	if (worker->exited) {
+		return false;
+	}
+
+	worker->tasks.push_back(std::move(task));
+	return true;
+}
+
+bool ThreadPool::_notifyIdle() {
+	/*
+	Pairs with the increment of waiters_ in _nextTask: either the idle worker
+	sees the task we just pushed when it checks the deques, or we see it waiting
+	*/
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+
+	if (waiters_ == 0) {
+		return false;
+	}
+
+	auto guard = _lockQueue();
+	cond_.notify_one();
+	return true;
+}
+
+void ThreadPool::_wakeIdle() {
+	if (!_notifyIdle() && currentThreads_ < maxThreads_) {
+		auto guard = _lockQueue();
+		if (!shutdown_ && waiters_ == 0 && currentThreads_ < maxThreads_) {
+			_spawnWorker();
+		}
+	}
+}
+
+void ThreadPool::_wakeForSlot() {
+	if (_notifyIdle()) {
+		return;
+	}
+	/*
+	Like Go's single spinning thread: chains of follow-ups fill slots all the
+	time, a spawn for each would grow the pool to its limit. The one spawned
+	clears slotSpawn_ once it steals a slot or parks
+	*/
+	if (currentThreads_ < maxThreads_ && !slotSpawn_.exchange(true, std::memory_order_acq_rel)) {
+		auto guard = _lockQueue();
+		if (!shutdown_ && waiters_ == 0 && currentThreads_ < maxThreads_) {
+			_spawnWorker();
+		}
+		else {
+			slotSpawn_.store(false, std::memory_order_release);
+		}
+	}
+}
+
+void ThreadPool::_wakeWorker(Worker* worker) {
+	// Pairs with the store to sleeping in _nextTask, as in _wakeIdle
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+
+	/*
+	Any idle worker woken would steal the task from the one it's hinted to.
+	All are notified, only worker finds work in its wait predicate, the
+	others go back to sleep
+	*/
+	if (worker->sleeping.load(std::memory_order_seq_cst)) {
+		auto guard = _lockQueue();
+		cond_.notify_all();
+	}
+}
+
+bool ThreadPool::_popLocal(Worker* self, QueuedTask& task) {
+	std::unique_lock<std::mutex> guard(self->mutex);
+
+	// Follow-up work of the task we just ran, its data is still in our cache
+	if (self->next && self->nextRuns < kMaxNextRuns) {
+		task = std::move(self->next);
+		++self->nextRuns;
+		return true;
+	}
+
+	// Let some other work run in between a long chain of follow-ups
+	self->nextRuns = 0;
+
+	if (self->tasks.empty()) {
+		return false;
+	}
+
+	// LIFO for owner, the latest task is most likely still in cache
+	task = std::move(self->tasks.back());
+	self->tasks.pop_back();
+	return true;
+}
+
+bool ThreadPool::_steal(Worker* self, QueuedTask& task) {
+	const unsigned n = workerCount_;
+	if (n == 0) {
+		return false;
+	}
+
+	// Start from our neighbour, so thieves do not all hit the same victim
+	unsigned start = 0;
+	for (unsigned i = 0; i < n; ++i) {
+		if (workers_[i].load() == self) {
+			start = i + 1;
+			break;
+		}
+	}
+
+	// Pinned workers try victims on their own NUMA node first
+	for (int pass = (self->node < 0 ? 1 : 0); pass < 2; ++pass) {
+		for (unsigned i = 0; i < n; ++i) {
+			Worker* victim = workers_[(start + i) % n];
+			if (victim == nullptr || victim == self) {
+				continue;
+			}
+
+			if (pass == 0 && victim->node != self->node) {
+				continue;
+			}
+
+			// Never block on a busy victim, just try the next one
+			std::unique_lock<std::mutex> guard(victim->mutex, std::try_to_lock);
+			if (!guard.owns_lock()) {
+				continue;
+			}
+
+			// FIFO for thieves, take the oldest task. In Shared mode the deques
+			// only hold tasks hinted to their owner, those stay, so do those
+			// hinted to a parked owner, which is being woken for them
+			if (mode_ == Mode::WorkStealing && !victim->tasks.empty() &&
+				!victim->sleeping.load(std::memory_order_relaxed)) {
+				task = std::move(victim->tasks.front());
+				victim->tasks.pop_front();
+				return true;
+			}
+
+			// The victim is still running the task which submitted it
+			if (victim->next) {
+				task = std::move(victim->next);
+				slotSpawn_.store(false, std::memory_order_release);
+				return true;
+			}
+		}
+	}
+
+	return false;
+}
+
+bool ThreadPool::_hasLocalWork(Worker* self) {
+	// Guarded by mutex_
+	const unsigned n = workerCount_;
+	for (unsigned i = 0; i < n; ++i) {
+		Worker* w = workers_[i];
+		// Parked with its deque filled, the task was hinted to it and it's being woken
+		if (w != self && w->sleeping.load(std::memory_order_relaxed)) {
+			continue;
+		}
+
+		std::unique_lock<std::mutex> guard(w->mutex);
+		if ((mode_ == Mode::WorkStealing && !w->tasks.empty()) || w->next) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+bool ThreadPool::_tryNextTask(Worker* self, QueuedTask& task) {
+	if (_popLocal(self, task)) {
+		return true;
+	}
+
+	{
+		std::unique_lock<std::mutex> local(self->mutex);
+		// _popLocal may hold the follow-up back for fairness
+		if (self->next) {
+			task = std::move(self->next);
+			return true;
+		}
+	}
+
+	if (_popRing(task)) {
+		return true;
+	}
+
+	if (queueSize_ > 0) {
+		auto guard = _lockQueue();
+		if (tasks_.pop(task)) {
+			_queueChanged();
+			return true;
+		}
+	}
+
+	return _steal(self, task);
+}
+
+std::unique_lock<std::mutex> ThreadPool::_lockQueue() {
+	std::unique_lock<std::mutex> guard(mutex_, std::try_to_lock);
+	if (guard.owns_lock()) {
+		return guard;
+	}
+
+	// Only a contended lock pays for reading the clock
+	const auto start = std::chrono::steady_clock::now();
+	guard.lock();
+	const uint64_t waited = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now() - start).count());
+
+	Worker* self = current_;
+	if (self && self->pool == this) {
+		bumpCounter(self->stats.lockContended, 1);
+		bumpCounter(self->stats.lockWait, waited);
+	}
+	else {
+		lockContended_.fetch_add(1, std::memory_order_relaxed);
+		lockWait_.fetch_add(waited, std::memory_order_relaxed);
+	}
+
+	return guard;
+}
+
+void ThreadPool::_countSubmitted(std::size_t n) {
+	Worker* self = current_;
+	if (self && self->pool == this) {
+		bumpCounter(self->stats.submitted, n);
+	}
+	else {
+		submitted_.fetch_add(n, std::memory_order_relaxed);
+	}
+}
+
+void ThreadPool::_queueChanged() {
+	queueSize_ = static_cast<unsigned>(tasks_.size());
+	urgent_ = tasks_.hasUrgent();
+}
+
+bool ThreadPool::_nextTask(Worker* self, QueuedTask& task) {
+	const bool stealing = (mode_ == Mode::WorkStealing);
+
+	// Now and then the global queues go first, a busy deque would starve them
+	if (++self->ticks % kGlobalPollInterval == 0) {
+		if (_popRing(task)) {
+			return true;
+		}
+
+		if (queueSize_ > 0) {
+			auto guard = _lockQueue();
+			if (tasks_.pop(task)) {
+				_queueChanged();
+				return true;
+			}
+		}
+	}
+
+	// Urgent work in the global queue goes before our own
+	if (!urgent_ && (_popLocal(self, task) || _popRing(task))) {
+		return true;
+	}
+
+	// Spin briefly before parking, new work often comes right after we ran out
+	for (int i = 0; i < kSpinCount && queueSize_ == 0; ++i) {
+		if (_popRing(task) || _steal(self, task)) {
+			return true;
+		}
+
+		std::this_thread::yield();
+	}
+
+	// Idle since the first time we park, a fixed size pool never recycles
+	bool parked = false;
+	std::chrono::steady_clock::time_point deadline;
+
+	auto guard = _lockQueue();
+	for (;;) {
+		if (tasks_.pop(task)) {
+			if (stealing && !tasks_.empty()) {
+				// Take a fair share of the injection queue, so we do not come back for every task
+				std::size_t batch = tasks_.size() / std::max(1U, currentThreads_.load());
+				batch = std::min<std::size_t>(batch, kInjectBatch);
+
+				std::unique_lock<std::mutex> local(self->mutex);
+				tasks_.popBatch(self->tasks, batch);
+			}
+
+			_queueChanged();
+			return true;
+		}
+
+		if (_popRing(task)) {
+			return true;
+		}
+
+		guard.unlock();
+		if (_steal(self, task)) {
+			return true;
+		}
+		guard.lock();
+
+		if (!tasks_.empty()) {
+			continue;
+		}
+
+		// A producer claimed a cell but has not filled it yet, give it the cpu without our lock
+		if (!_ringEmpty()) {
+			guard.unlock();
+			std::this_thread::yield();
+			guard.lock();
+			continue;
+		}
+
+		// Our follow-up slot may be held back by _popLocal, never park on it
+		// Tasks hinted to us may arrive until we mark ourselves exited
+		{
+			std::unique_lock<std::mutex> local(self->mutex);
+			if (self->next) {
+				task = std::move(self->next);
+				return true;
+			}
+
+			if (!self->tasks.empty()) {
+				task = std::move(self->tasks.back());
+				self->tasks.pop_back();
+				return true;
+			}
+
+			// 如果已经shutdown并且任务为空的话，就返回false
+			// 在WorkStealing模式下，其它worker的deque由它们自己清空
+			if (shutdown_) {
+				self->exited = true;
+				return false;
+			}
+		}
+
+		if (!parked) {
+			parked = true;
+			// Nothing waits in queue any more
+			_stopShedding();
+			deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(maxIdleTime_.load());
+		}
+
+		++waiters_;
+		self->sleeping.store(true, std::memory_order_seq_cst);
+		slotSpawn_.store(false, std::memory_order_release);
+		/*
+		wait causes the current thread to block until the condition variable
+		is notified or a spurious wakeup occurs,
+		optionally looping until some predicate is satisfied
+		这里给wait传了第二个参数，是一个谓词，returns false if the waiting should
+		be continued
+
+		当shutdown_了或者tasks_不为空的话(表明已经有task可以做了)停止等待
+		wait_until超时返回false，表明这个worker已经空闲了maxIdleTime_
+		*/
+		auto ready = [this, self]() {
+			return shutdown_ || !tasks_.empty() || !_ringEmpty() || _hasLocalWork(self);
+		};
+
+		if (fixed_) {
+			cond_.wait(guard, ready);
+		}
+		else if (!cond_.wait_until(guard, deadline, ready) && waiters_ > maxIdleThreads_) {
+			// Idle too long and there are enough idle threads without us
+			self->sleeping.store(false, std::memory_order_relaxed);
 			--waiters_;
+			working_ = false;
+			return false;
+		}
+		self->sleeping.store(false, std::memory_order_relaxed);
+		--waiters_;
+	}
+}
 
-			assert(shutdown_ || !tasks_.empty());
+void ThreadPool::_workerRoutine(Worker* self) {
+	// working_是一个thread_local的变量，表明每个thread都有一个自己的副本
+	working_ = true;
+	current_ = self;
+	Scheduler::setCurrent(this);
+
+	if (self->cpu >= 0) {
+		CpuTopology::pinCurrentThread(self->cpu);
+	}
+
+	while (working_) {
+		QueuedTask task;
 
-			// 如果已经shutdown并且任务为空的话，就将当前thread的数量-1并返回
-			if (shutdown_ && tasks_.empty()) {
-				--currentThreads_;
-				return;
+		if (!_nextTask(self, task)) {
+			if (!working_) {
+				break;
 			}
 
-			assert(!tasks_.empty());
-			task = std::move(tasks_.front());
-			tasks_.pop_front();
+			std::unique_lock<std::mutex> guard(mutex_);
+			--currentThreads_;
+			return;
+		}
+
+		_runTask(self, task);
+	}
+
+	// If reach here, this thread has been idle for too long
+	_retireWorker(self);
+}
+
+void ThreadPool::_runTask(Worker* self, QueuedTask& task) {
+	WorkerStats& stats = self->stats;
+	const bool tagged = (task.tag != 0);
+
+	const auto start = std::chrono::steady_clock::now();
+	stats.queueTime.add(start - task.queued);
+	_sampleSojourn(start, start - task.queued);
+
+	// Tasks we run while this one waits on a future add theirs here
+	RunningTask run;
+	run.start = start;
+	run.outerCpu = stats.nestedCpu;
+	run.outerWall = stats.nestedWall;
+	run.tag = task.tag;
+	run.claimed = false;
+	run.counted = false;
+	stats.nestedCpu = 0;
+	stats.nestedWall = 0;
+	run.cpuStart = tagged ? threadCpuTime() : 0;
+
+	RunningTask* outer = self->running;
+	self->running = &run;
+	task.task();
+	self->running = outer;
+
+	// Tasks not made by _makeTask have no TaskCounter
+	if (!run.counted) {
+		_countRun(self, run);
+	}
+}
+
+ThreadPool::TaskCounter::TaskCounter() :
+	run_(nullptr) {
+	Worker* self = current_;
+	if (self && self->running && !self->running->claimed) {
+		run_ = self->running;
+		run_->claimed = true;
+	}
+}
+
+ThreadPool::TaskCounter::~TaskCounter() {
+	if (run_) {
+		_countRun(current_, *run_);
+	}
+}
+
+void ThreadPool::_countRun(Worker* self, RunningTask& run) {
+	WorkerStats& stats = self->stats;
+	const bool tagged = (run.tag != 0);
+	run.counted = true;
+
+	const uint64_t cpu = tagged ? threadCpuTime() - run.cpuStart : 0;
+	const auto elapsed = std::chrono::steady_clock::now() - run.start;
+	const uint64_t wall = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+	stats.runTime.add(elapsed);
+
+	TagCounters* tags = stats.tags.load(std::memory_order_relaxed);
+	if (tags == nullptr) {
+		tags = new TagCounters[kMaxTags];
+		stats.tags.store(tags, std::memory_order_release);
+	}
+
+	// Only our own share, nested tasks are billed to their tags
+	TagCounters& counters = tags[run.tag];
+	bumpCounter(counters.tasks, 1);
+	bumpCounter(counters.wallTime, wall - std::min(wall, stats.nestedWall));
+	if (tagged) {
+		bumpCounter(counters.cpuTime, cpu - std::min(cpu, stats.nestedCpu));
+	}
+
+	stats.nestedCpu = run.outerCpu + cpu;
+	stats.nestedWall = run.outerWall + wall;
+}
+
+bool ThreadPool::_shouldShed(const TaskOptions& options) const {
+	if (!shedding_.load(std::memory_order_relaxed) ||
+		options.onFull == OnFull::Spill || options.priority == Priority::High) {
+		return false;
+	}
+
+	Worker* self = current_;
+	return !(self && self->pool == this);
+}
+
+void ThreadPool::_sampleSojourn(const TimePoint& now, std::chrono::steady_clock::duration sojourn) {
+	const long long target = admissionTarget_.load(std::memory_order_relaxed);
+	if (target == 0) {
+		return;
+	}
+
+	// Only write shared state when it changes, it's read by every task start
+	if (std::chrono::duration_cast<std::chrono::nanoseconds>(sojourn).count() < target) {
+		if (aboveTargetSince_.load(std::memory_order_relaxed) != 0) {
+			_stopShedding();
+		}
+		return;
+	}
+
+	const long long stamp = std::chrono::duration_cast<std::chrono::nanoseconds>(now.time_since_epoch()).count();
+	long long since = aboveTargetSince_.load(std::memory_order_relaxed);
+	if (since == 0) {
+		// The first one above target, the interval starts here
+		aboveTargetSince_.compare_exchange_strong(since, stamp, std::memory_order_relaxed);
+	}
+	else if (stamp - since >= admissionInterval_.load(std::memory_order_relaxed) &&
+		!shedding_.load(std::memory_order_relaxed)) {
+		shedding_.store(true, std::memory_order_relaxed);
+	}
+}
+
+void ThreadPool::_stopShedding() {
+	if (aboveTargetSince_.load(std::memory_order_relaxed) != 0) {
+		aboveTargetSince_.store(0, std::memory_order_relaxed);
+	}
+	if (shedding_.load(std::memory_order_relaxed)) {
+		shedding_.store(false, std::memory_order_relaxed);
+	}
+}
+
+void ThreadPool::_retireWorker(Worker* self) {
+	std::deque<QueuedTask> orphans;
+	{
+		std::unique_lock<std::mutex> guard(self->mutex);
+		orphans.swap(self->tasks);
+		if (self->next) {
+			orphans.push_back(std::move(self->next));
 		}
+	}
 
-		task();
+	std::unique_lock<std::mutex> guard(mutex_);
+
+	// Hand our pending local work to the others
+	if (!orphans.empty()) {
+		for (auto& t : orphans) {
+			tasks_.push(std::move(t));
+		}
+		_queueChanged();
+		cond_.notify_all();
 	}
 
-	// If reach here, this thread is recycled by monitor thread
 	--currentThreads_;
-	--pendingStopSignal_;
+	++retired_;
+
+	for (unsigned i = 0; i < workerCount_; ++i) {
+		if (workers_[i].load() == self) {
+			retiredSlots_.push_back(i);
+			break;
+		}
+	}
 }
 
-void ThreadPool::_spawnWorker() {
+void ThreadPool::_spawnWorker(int cpu, int node) {
 	/*
 	Guared by mutex
 
 	将当前的线程数量增加1
-	创建一个新的线程capture这个ThreadPool class本身，并且去执行_workRoutine()这个函数
-	最后将这个新创建的线程加入workers_中去
+	找到一个空闲的slot(或者新建一个)，创建一个新的线程capture这个ThreadPool class本身
+	以及它的Worker，并且去执行_workRoutine()这个函数
 	*/
+	Worker* worker = nullptr;
+	// Only an elastic pool retires workers, they are never pinned
+	if (!retiredSlots_.empty() && cpu < 0) {
+		worker = workers_[retiredSlots_.back()];
+		retiredSlots_.pop_back();
+
+		// The retired thread has done everything under lock, it's about to exit
+		if (worker->thread.joinable()) {
+			worker->thread.join();
+		}
+	}
+	else {
+		worker = new Worker(this, cpu, node);
+		workers_[workerCount_] = worker;
+		++workerCount_;
+	}
+
 	++currentThreads_;
-	std::thread t([this]() {
-		this->_workerRoutine();
+	++spawned_;
+	worker->thread = std::thread([this, worker]() {
+		this->_workerRoutine(worker);
 	});
-	workers_.push_back(std::move(t));
 }
 
-}
\ No newline at end of file
+}
@@ -1,11 +1,22 @@
 ﻿#pragma once
 
 #include <deque>
+#include <map>
+#include <algorithm>
 #include <atomic>
+#include <chrono>
 #include <memory>
 #include <thread>
+#include <vector>
 #include <condition_variable>
+#include <stdexcept>
 #include "..//future/Future.h"
+#include "CpuTopology.h"
+#include "Fiber.h"
+#include "Histogram.h"
+#include "MpmcQueue.h"
+#include "TaskQueue.h"
+#include "Timer.h"
 
 /*
 * A ThreadPool implementation with Future interface
@@ -23,9 +34,186 @@
 
 namespace Quokka {
 
-class ThreadPool final {
+// The exception of a future rejected because the pool's queue is full
+class QueueFullError : public std::runtime_error {
 public:
-	ThreadPool();
+	QueueFullError() :
+		std::runtime_error("ThreadPool queue is full") {
+	}
+};
+
+// The exception of a future rejected by admission control, see setAdmissionControl
+class OverloadedError : public std::runtime_error {
+public:
+	OverloadedError() :
+		std::runtime_error("ThreadPool is overloaded") {
+	}
+};
+
+class ThreadPool final : public Scheduler {
+public:
+
+	/*
+	How queued work is handed to workers
+
+	Shared: all workers pop from one locked queue, strict FIFO
+	WorkStealing: each worker owns a deque, it pushes and pops work submitted
+	from itself at the back, idle workers steal from the front of others' deques.
+	Work submitted from outside the pool goes to a global injection queue
+	*/
+	enum class Mode {
+		Shared,
+		WorkStealing
+	};
+
+	enum class Affinity {
+		None,
+		PinToCores
+	};
+
+	/*
+	What execute does when a bounded queue is full, see
+	ThreadPool(Mode, std::size_t, Overflow)
+
+	Block: wait until a worker takes a task
+	Fail: return a future failed with QueueFullError
+	*/
+	enum class Overflow {
+		Block,
+		Fail
+	};
+
+	/*
+	Where a task would like to run, see execute(const Locality&, ...)
+
+	Core: on the worker pinned to that cpu
+	Node: on one of the workers of that NUMA node
+	*/
+	struct Locality {
+		enum class Kind {
+			Any,
+			Node,
+			Core
+		};
+
+		static Locality any() {
+			return Locality{ Kind::Any, -1 };
+		}
+
+		static Locality node(int node) {
+			return Locality{ Kind::Node, node };
+		}
+
+		static Locality core(int cpu) {
+			return Locality{ Kind::Core, cpu };
+		}
+
+		Kind kind;
+		int index;
+	};
+
+	/*
+	Order of queued work, see execute(Priority, ...)
+	High is served before Normal before Low, a lane passed over too many
+	times is served anyway, so Low work still makes progress
+	*/
+	using Priority = TaskPriority;
+	using TimePoint = std::chrono::steady_clock::time_point;
+
+	/*
+	Who a task is billed to, see execute(const Tag&, ...)
+	id in [1, kMaxTags), 0 and ids out of range count as untagged work
+	*/
+	struct Tag {
+		explicit Tag(unsigned i) :
+			id(i < kMaxTags ? i : 0) {
+		}
+
+		unsigned id;
+	};
+
+	// Time used by tasks of one tag, see tagUsage()
+	struct TagUsage {
+		unsigned tag;
+		uint64_t tasks;
+		// Thread cpu time and wall time spent running them, not waiting in queue
+		std::chrono::nanoseconds cpuTime;
+		std::chrono::nanoseconds wallTime;
+	};
+
+	static const unsigned kMaxTags = 256;
+
+	/*
+	What the pool has been doing, see stats()
+
+	Counters and histograms are totals since the pool was created,
+	diff two snapshots to get rates over a window
+	*/
+	struct Stats {
+		// Since the pool was created
+		std::chrono::steady_clock::duration uptime;
+
+		// Tasks queued and tasks run
+		uint64_t submitted;
+		uint64_t executed;
+
+		// Tasks refused because a bounded queue was full
+		uint64_t rejected;
+		// Tasks refused by admission control, and if it is refusing right now
+		uint64_t shed;
+		bool overloaded;
+
+		// Tasks waiting right now, in the global queue or bounded ring
+		// and in workers' own deques and follow-up slots
+		std::size_t globalQueueDepth;
+		std::size_t localQueueDepth;
+
+		unsigned threads;
+		unsigned idleThreads;
+		// Workers started, and workers recycled after idling too long
+		uint64_t spawned;
+		uint64_t retired;
+
+		// From queued to started, and from started to done
+		Histogram queueTime;
+		Histogram runTime;
+
+		// Times the global queue lock was busy when we wanted it,
+		// and how long we waited for it in total
+		uint64_t lockContended;
+		std::chrono::nanoseconds lockWait;
+
+		// Tasks submitted per second since the pool was created
+		double enqueueRate() const;
+	};
+
+	explicit ThreadPool(Mode mode = Mode::Shared);
+
+	/*
+	Fixed size pool
+
+	Starts `threads` workers up front in WorkStealing mode, no worker is
+	spawned on demand or recycled later.
+	0 means one worker per cpu this process may run on.
+	With Affinity::PinToCores, workers are pinned to cpus read from
+	/sys/devices/system/cpu, spread over NUMA nodes and physical cores,
+	thieves prefer victims on their own node.
+	*/
+	ThreadPool(unsigned int threads, Affinity affinity);
+
+	/*
+	Pool with a bounded queue
+
+	Work submitted from outside the pool goes to a lock free ring of
+	queueCapacity tasks (rounded up to a power of two) instead of the locked
+	global queue. When it is full, execute blocks or fails as whenFull says,
+	tryExecute fails at once.
+	Only plain execute, executeBatch and parallelFor from other threads are
+	bounded, batches always wait for room. Workers, timers and continuations
+	never wait: what they submit goes where it would in an unbounded pool,
+	so does prioritized, deadline and locality hinted work
+	*/
+	ThreadPool(Mode mode, std::size_t queueCapacity, Overflow whenFull = Overflow::Block);
 	~ThreadPool();
 
 	ThreadPool(const ThreadPool&) = delete;
@@ -40,63 +228,429 @@ public:
 	idle threads, f will be executed at once.
 	But if all threads are busy and threads size reach limit,
 	f will be queueing and executed later.
+	*/
+	template<typename F, typename... Args>
+	auto execute(F&& f, Args&& ... args)->Future<typename std::result_of<F(Args...)>::type>;
+
+	/*
+	Execute work which blocks, on disk, network or locks
+
+	It runs on a separate elastic set of threads with its own limits, see
+	setMaxBlockingThreads, so blocked calls neither hold up CPU work nor make
+	this pool grow. Pair it with a fixed pool sized to the cores,
+	ThreadPool(0, Affinity::None), for the CPU work.
+	Returns the same future as execute, they compose freely
+	*/
+	template<typename F, typename... Args>
+	auto executeBlocking(F&& f, Args&& ... args)->Future<typename std::result_of<F(Args...)>::type>;
+
+	/*
+	Execute blocking style code on a fiber of this pool, see Fiber
 
-	F returns non-void
+	When f calls Future::wait, its fiber is parked and the worker runs
+	other work, the fiber goes on once the value is set. So a pool sized
+	to the cores serves many such requests at once, without a thread each.
+	Other blocking calls still block the worker, use executeBlocking for them
 	*/
-	template<typename F, typename... Args,
-		typename = typename std::enable_if<!std::is_void<typename std::result_of<F(Args...)>::type>::value, void>::type,
-		typename Dummy = void>
-	auto execute(F && f, Args && ... args)->Future<typename std::result_of<F(Args...)>::type>;
+	template<typename F, typename... Args>
+	auto executeFiber(F&& f, Args&& ... args)->Future<typename std::result_of<F(Args...)>::type>;
 
 	/*
-	Same as above
-	
-	F returns void
+	Scheduler of the blocking lane, to run a continuation there:
+
+	pool.execute(parse).then(pool.blockingScheduler(), writeToDisk)
 	*/
-	template<typename F, typename... Args,
-		typename = typename std::enable_if<std::is_void<typename std::result_of<F(Args...)>::type>::value, void>::type>
-	auto execute(F&& f, Args&& ... args)->Future<void>;
+	Scheduler* blockingScheduler();
+
+	/*
+	Same as execute(f, args...), but never waits for room in a bounded queue
+
+	Returns an invalid future, see Future::valid(), if the queue is full.
+	Always succeeds in an unbounded pool or when called from its workers
+	*/
+	template<typename F, typename... Args>
+	auto tryExecute(F&& f, Args&& ... args)->Future<typename std::result_of<F(Args...)>::type>;
+
+	/*
+	Same as above, but keep f near the memory it works on
+
+	Only honored by a pool with pinned workers, f is queued on the worker
+	pinned to the hinted cpu or on a worker of the hinted node, it may still
+	be stolen by an idle worker. Otherwise it's the same as execute(f, args...)
+	*/
+	template<typename F, typename... Args>
+	auto execute(const Locality& where, F&& f, Args&& ... args)->Future<typename std::result_of<F(Args...)>::type>;
+
+	/*
+	Execute f(item) for each item of range
+
+	All tasks are queued under one lock acquisition with one wake up
+	broadcast, instead of one per task. Each item is copied into its task.
+	Returns one future per item, in the order of range
+	*/
+	template<typename Range, typename F>
+	auto executeBatch(const Range& range, F&& f)
+		->std::vector<Future<typename std::result_of<F(const typename std::decay<decltype(*std::begin(range))>::type&)>::type>>;
+
+	/*
+	Execute f(i) for every i in [begin, end)
+
+	The range is split into chunks of grain indexes, each chunk is one task,
+	all queued at once like executeBatch. 0 grain means about 4 chunks per thread.
+	The returned future is done when all chunks are done, it holds the first
+	exception thrown by f, if any
+	*/
+	template<typename Index, typename F>
+	Future<void> parallelFor(Index begin, Index end, Index grain, F&& f);
+
+	/*
+	Same as execute(f, args...), but the thread cpu time and wall time of f
+	are added up under tag, see tagUsage()
+
+	Only tagged tasks read the thread cpu clock. Time a task spends running
+	other tasks while it waits on a future is billed to those, not to it
+	*/
+	template<typename F, typename... Args>
+	auto execute(const Tag& tag, F&& f, Args&& ... args)->Future<typename std::result_of<F(Args...)>::type>;
+
+	/*
+	Same as execute(f, args...), but queued in the lane of priority
+
+	Prioritized work always goes through the global queue, and workers
+	check it before their own deques when it has High or deadline work
+	*/
+	template<typename F, typename... Args>
+	auto execute(Priority priority, F&& f, Args&& ... args)->Future<typename std::result_of<F(Args...)>::type>;
+
+	/*
+	Same as execute(f, args...), but served earliest deadline first,
+	ahead of all priority lanes. A late task is still executed
+	*/
+	template<typename F, typename... Args>
+	auto execute(const TimePoint& deadline, F&& f, Args&& ... args)->Future<typename std::result_of<F(Args...)>::type>;
+
+	/*
+	Scheduler interface, so continuations and timeouts run on the workers:
+
+	future.then(&pool, f)
+	future.onTimeout(duration, f, &pool)
+
+	schedule queues f like execute. schedulerLater queues f after duration,
+	all delayed tasks share one TimerManager driven by one timer thread,
+	started on first use.
+	Tasks scheduled after the pool is shutdown are dropped
+	*/
+	void schedule(Task f) override;
+	void schedulerLater(std::chrono::milliseconds duration, Task f) override;
+
+	/*
+	If called on one of our workers, run one queued task in place:
+	its follow-up slot and deque first, then the global queue, then steal.
+	Future::wait on a worker calls it, so nested fork/join code neither
+	stalls a worker nor needs the pool to grow
+	*/
+	bool runPendingTask() override;
 
 	// Stop thread pool and wait all threads terminate
 	void joinAll();
 
 	/*
-	Set max size of idle threads
+	Set max size of idle threads, no effect on fixed size pool
 
 	Details about threads in pool:
 	Busy threads, they are doing work on behalf of us
-	Idle threads, they are waiting on a queue for new work
-	Monitor thread, the internal thread, only one, it'll check
-	the size of idle threads periodly, if there are too many idle
-	threads, they will be recycled by monitor thread
+	Idle threads, they spin briefly, then wait on a queue for new work,
+	if one has waited longer than max idle time and there are more idle
+	threads than this limit, it exits by itself
 	*/
 	void setMaxIdleThreads(unsigned int);
 
 	/*
-	Set max size of idle threads
+	Set how long a thread may stay idle before it's recycled, no effect on
+	fixed size pool
+	Default value is 300ms
+	*/
+	void setMaxIdleTime(std::chrono::milliseconds);
+
+	/*
+	Set max size of threads, no effect on fixed size pool
 
-	Max threads size is the total of idle threads and busy threads,
-	not include monitor thread.
+	Max threads size is the total of idle threads and busy threads.
 	Default value is 1024
 	Example: if you setMaxThreads(8), setMaxIdleThreads(2)
 	and now execute 8 long working, there will be 8 busy threads,
 	0 idle thread, when all work done, will be 0 busy thread, 2 idle
-	threads, other 6 threads are recycled by monitor thread
+	threads, other 6 threads exit after max idle time
 	*/
 	void setMaxThreads(unsigned int);
 
+	/*
+	Shed load when tasks wait too long in queue, CoDel style, off by default
+
+	Once the shortest time a task waited before it started stays above
+	target for a whole interval, the pool is overloaded: execute, executeBatch
+	and parallelFor called from outside the pool return futures failed with
+	OverloadedError, instead of queueing work nobody will wait for.
+	It ends as soon as a task waited less than target, or a worker runs out of work.
+	High priority work, and what workers, timers and continuations submit,
+	is never rejected. 0 target turns it off
+	*/
+	void setAdmissionControl(std::chrono::microseconds target,
+		std::chrono::microseconds interval = std::chrono::milliseconds(100));
+
+	/*
+	Snapshot of the pool's counters
+
+	Workers keep their own counters without any shared write,
+	they are only summed up here, so it's cheap to keep them on
+	but stats() itself briefly locks every worker
+	*/
+	Stats stats() const;
+
+	/*
+	Limits of the blocking lane, its threads are spawned on demand up to
+	max blocking threads, default 128, then blocking work queues up.
+	Idle ones are recycled like in an elastic pool
+	*/
+	void setMaxBlockingThreads(unsigned int);
+	void setMaxIdleBlockingThreads(unsigned int);
+
+	// Snapshot of the blocking lane's counters
+	Stats blockingStats() const;
+
+	/*
+	Totals of every tag which has run a task, summed up from per worker
+	tables like stats(), so it's cheap enough to export periodically.
+	Tag 0 counts untagged tasks' wall time only
+	*/
+	std::vector<TagUsage> tagUsage() const;
+
 private:
-	void _spawnWorker();
-	void _workerRoutine();
-	void _monitorRoutine();
+	// Per tag counters of one worker, in nanoseconds
+	struct TagCounters {
+		TagCounters() :
+			tasks(0),
+			cpuTime(0),
+			wallTime(0) {
+		}
+
+		std::atomic<uint64_t> tasks;
+		std::atomic<uint64_t> cpuTime;
+		std::atomic<uint64_t> wallTime;
+	};
 
-	// Recycle redundant threads
-	std::thread monitor_;
+	// Counters of one worker, written by its own thread only
+	struct WorkerStats {
+		WorkerStats() :
+			submitted(0),
+			lockContended(0),
+			lockWait(0),
+			tags(nullptr),
+			nestedCpu(0),
+			nestedWall(0) {
+		}
+
+		~WorkerStats() {
+			delete[] tags.load();
+		}
+
+		std::atomic<uint64_t> submitted;
+		std::atomic<uint64_t> lockContended;
+		// In nanoseconds
+		std::atomic<uint64_t> lockWait;
+		Histogram queueTime;
+		Histogram runTime;
+
+		// kMaxTags entries, allocated by the first task
+		std::atomic<TagCounters*> tags;
+		// Time of tasks run inside the running one, while it waited on a future
+		uint64_t nestedCpu;
+		uint64_t nestedWall;
+	};
+
+	// The task _runTask is running, counted in WorkerStats once
+	struct RunningTask {
+		std::chrono::steady_clock::time_point start;
+		uint64_t cpuStart;
+		// nestedCpu and nestedWall of the task we run inside of
+		uint64_t outerCpu;
+		uint64_t outerWall;
+		unsigned tag;
+		// Taken by the first TaskCounter, the one of the task itself
+		bool claimed;
+		bool counted;
+	};
+
+	/*
+	Counts the running task when its function returns or throws, before the
+	promise is set, so stats() and tagUsage() right after wait() see it
+	*/
+	class TaskCounter {
+	public:
+		TaskCounter();
+		~TaskCounter();
+
+		TaskCounter(const TaskCounter&) = delete;
+		TaskCounter& operator=(const TaskCounter&) = delete;
+
+	private:
+		RunningTask* run_;
+	};
+
+	struct Worker {
+		Worker(ThreadPool* p, int c, int n) :
+			pool(p),
+			cpu(c),
+			node(n),
+			nextRuns(0),
+			ticks(0),
+			exited(false),
+			sleeping(false),
+			running(nullptr) {
+		}
+
+		ThreadPool* const pool;
+		std::thread thread;
+		// Pinned cpu and its NUMA node, -1 if not pinned
+		const int cpu;
+		const int node;
+
+		// Local deque, only used in WorkStealing mode, guarded by mutex
+		// Owner works at the back, thieves take from the front
+		std::mutex mutex;
+		std::deque<QueuedTask> tasks;
+		/*
+		Task submitted by the task running on this worker, it's run right
+		after that, LIFO, unless an idle worker steals it first. Taken
+		kMaxNextRuns times in a row at most, then other work gets a turn
+		*/
+		QueuedTask next;
+		int nextRuns;
+		// Tasks taken, only touched by the owner
+		unsigned ticks;
+		// Guarded by mutex, set when the worker leaves for shutdown
+		bool exited;
+		// Parked on cond_, written under mutex_ of the pool
+		std::atomic<bool> sleeping;
+		// Innermost task run by this worker, only touched by the owner
+		RunningTask* running;
+
+		WorkerStats stats;
+	};
+
+	// Where a task submitted to a full bounded queue goes
+	enum class OnFull {
+		// As the pool's Overflow says
+		Default,
+		Fail,
+		// To the unbounded global queue, for those who must not wait or fail
+		Spill
+	};
+
+	enum class Submitted {
+		Queued,
+		Shutdown,
+		Full,
+		Overloaded
+	};
+
+	// How a task is queued
+	struct TaskOptions {
+		TaskOptions() :
+			where(Locality::any()),
+			priority(Priority::Normal),
+			deadline(TimePoint::max()),
+			onFull(OnFull::Default),
+			tag(0) {
+		}
+
+		// Goes to the global queue in order, not to a worker's deque
+		bool ordered() const {
+			return priority != Priority::Normal || deadline != TimePoint::max();
+		}
+
+		Locality where;
+		Priority priority;
+		TimePoint deadline;
+		OnFull onFull;
+		unsigned tag;
+	};
+
+	ThreadPool(Mode mode, bool fixed, std::size_t queueCapacity, Overflow whenFull);
+
+	// Called by public constructors only, the blocking lane has no lane itself
+	void _startBlockingLane();
+
+	template<typename F, typename... Args>
+	auto _execute(const TaskOptions& options, F&& f, Args&& ... args)->Future<typename std::result_of<F(Args...)>::type>;
+
+	// Wrap func into a task which sets the result to pm, or drops func if pm was cancelled meanwhile
+	template<typename R, typename Func>
+	static Task _makeTask(Promise<R>&& pm, Func&& func);
+
+	// Future returned for work submitted after shutdown
+	template<typename R>
+	static Future<R> _shutdownFuture(std::false_type /* R is not void */);
+	template<typename R>
+	static Future<R> _shutdownFuture(std::true_type /* R is void */);
+
+	// Queue a wrapped task
+	Submitted _submit(Task&& task, const TaskOptions& options);
+	// Push to ring_, waiting for room if block, returns false if not pushed
+	bool _pushRing(QueuedTask& task, bool block);
+	// Pop from ring_ and wake a producer waiting for room
+	bool _popRing(QueuedTask& task);
+	bool _ringEmpty() const;
+	// Queue all tasks at once
+	Submitted _submitBatch(std::vector<Task>&& tasks);
+	// Start workers for a batch of n tasks, guarded by mutex_
+	void _spawnForBatch(std::size_t n);
+	// Worker to queue a hinted task on, nullptr if the hint can't be honored
+	Worker* _localityWorker(const Locality& where);
+	bool _pushTo(Worker* worker, QueuedTask& task);
+	bool _popLocal(Worker* self, QueuedTask& task);
+	bool _steal(Worker* self, QueuedTask& task);
+	bool _hasLocalWork(Worker* self);
+	// Refresh queueSize_ and urgent_ after tasks_ changed, guarded by mutex_
+	void _queueChanged();
+	// Wake a parked worker, returns false if none is parked
+	bool _notifyIdle();
+	// Wake a parked worker, or spawn one if none is
+	void _wakeIdle();
+	// Wake worker for a task hinted to it, unless it's running and will find it
+	void _wakeWorker(Worker* worker);
+	// _wakeIdle for a filled next slot, at most one spawned worker on the way
+	void _wakeForSlot();
+	// Never blocks, returns false if there is no task for now
+	bool _tryNextTask(Worker* self, QueuedTask& task);
+	// Blocks until there is a task, returns false if pool is shutdown and no work left
+	bool _nextTask(Worker* self, QueuedTask& task);
+	void _runTask(Worker* self, QueuedTask& task);
+	static void _countRun(Worker* self, RunningTask& run);
+
+	// Admission control, see setAdmissionControl
+	bool _shouldShed(const TaskOptions& options) const;
+	void _sampleSojourn(const TimePoint& now, std::chrono::steady_clock::duration sojourn);
+	void _stopShedding();
+
+	// Lock mutex_, counting the time spent waiting for it
+	std::unique_lock<std::mutex> _lockQueue();
+	void _countSubmitted(std::size_t n);
+
+	void _spawnWorker(int cpu = -1, int node = -1);
+	void _retireWorker(Worker* self);
+	void _workerRoutine(Worker* self);
+	void _timerRoutine();
+
+	const Mode mode_;
+	const bool fixed_;
+	const Overflow overflow_;
 
 	std::atomic<unsigned> maxThreads_;
 	std::atomic<unsigned> currentThreads_;
 	std::atomic<unsigned> maxIdleThreads_;
-	std::atomic<unsigned> pendingStopSignal_;
+	// In milliseconds
+	std::atomic<long long> maxIdleTime_;
 
 	/*
 	变量存储
@@ -135,34 +689,160 @@ private:
 	4. thread_local可以和static或extern联合使用
 	*/
 	static thread_local bool working_;
+	// The worker running on this thread, nullptr for non-pool threads
+	static thread_local Worker* current_;
+
+	/*
+	Slots of all workers ever spawned, never shrink and a worker is not freed
+	until the pool destructs, so thieves can scan [0, workerCount_) without lock.
+	A retired worker's slot is reused by the next spawn
+	*/
+	std::unique_ptr<std::atomic<Worker*>[]> workers_;
+	std::atomic<unsigned> workerCount_;
+	std::vector<unsigned> retiredSlots_;
 
-	std::deque<std::thread> workers_;
+	// Pinned workers by cpu and by node, built in constructor and read only later
+	std::map<int, Worker*> cpuWorkers_;
+	std::vector<std::vector<Worker*>> nodeWorkers_;
+	std::atomic<unsigned> nextNodeWorker_;
 
-	std::mutex mutex_;
+	mutable std::mutex mutex_;
 	std::condition_variable cond_;
-	unsigned waiters_;
-	bool shutdown_;
-	std::deque<std::function<void()>> tasks_;
+	std::atomic<unsigned> waiters_;
+	// A worker was spawned for a filled next slot and has not stolen or parked yet
+	std::atomic<bool> slotSpawn_;
+	// Written under mutex_, read without it by bounded queue producers
+	std::atomic<bool> shutdown_;
+	// The only queue in Shared mode, the injection queue in WorkStealing mode
+	TaskQueue tasks_;
+	// Size of tasks_ and if it has urgent work, readable without lock
+	std::atomic<unsigned> queueSize_;
+	std::atomic<bool> urgent_;
+
+	// Bounded queue of plain submissions from outside, nullptr if unbounded
+	std::unique_ptr<MpmcQueue<QueuedTask>> ring_;
+	// Producers waiting for room in ring_
+	std::mutex spaceMutex_;
+	std::condition_variable spaceCond_;
+	std::atomic<unsigned> blockedProducers_;
+
+	// Stats not owned by a worker: work and lock waits of other threads,
+	// spawned_ and retired_ are guarded by mutex_
+	const TimePoint created_;
+	std::atomic<uint64_t> submitted_;
+	std::atomic<uint64_t> rejected_;
+
+	// Admission control, in nanoseconds, 0 target if off
+	std::atomic<long long> admissionTarget_;
+	std::atomic<long long> admissionInterval_;
+	// When tasks started to wait longer than target, 0 if the last one did not
+	std::atomic<long long> aboveTargetSince_;
+	std::atomic<bool> shedding_;
+	std::atomic<uint64_t> shed_;
+	std::atomic<uint64_t> lockContended_;
+	std::atomic<uint64_t> lockWait_;
+	uint64_t spawned_;
+	uint64_t retired_;
+
+	// Elastic pool running executeBlocking work
+	std::unique_ptr<ThreadPool> blocking_;
+
+	// Delayed tasks of schedulerLater, guarded by timerMutex_
+	TimerManager timers_;
+	std::thread timerThread_;
+	std::mutex timerMutex_;
+	std::condition_variable timerCond_;
+	bool timerShutdown_;
 
 	static const int kMaxThreads = 1024;
+	static const int kDefaultMaxBlockingThreads = 128;
+	// Max tasks a worker moves from injection queue to its own deque at once
+	static const int kInjectBatch = 16;
+	static const int kMaxNextRuns = 8;
+	// Every that many tasks a worker looks at the global queues first, as Go and Tokio do
+	static const unsigned kGlobalPollInterval = 61;
+	// Times an idle worker looks for work before parking
+	static const int kSpinCount = 64;
+	static constexpr std::chrono::milliseconds kDefaultMaxIdleTime{ 300 };
+	// Longest a blocked producer sleeps before trying the ring again
+	static constexpr std::chrono::milliseconds kFullWaitSlice{ 1 };
 	static std::thread::id s_mainThread;
 };
 
-// If F returns something
-template<typename F, typename... Args, typename, typename>
-auto ThreadPool::execute(F && f, Args && ... args) -> Future<typename std::result_of<F(Args...)>::type> {
-	// resultType为调用F(Args...)的实际类型
+template<typename F, typename... Args>
+auto ThreadPool::execute(F&& f, Args&& ... args) -> Future<typename std::result_of<F(Args...)>::type> {
+	return _execute(TaskOptions(), std::forward<F>(f), std::forward<Args>(args)...);
+}
+
+template<typename F, typename... Args>
+auto ThreadPool::executeBlocking(F&& f, Args&& ... args) -> Future<typename std::result_of<F(Args...)>::type> {
+	return blocking_->execute(std::forward<F>(f), std::forward<Args>(args)...);
+}
+
+template<typename F, typename... Args>
+auto ThreadPool::executeFiber(F&& f, Args&& ... args) -> Future<typename std::result_of<F(Args...)>::type> {
 	using resultType = typename std::result_of<F(Args...)>::type;
+	using isVoid = typename std::is_void<resultType>::type;
 
-	/*
-	使用当前ThreadPool class中的mutex_进行上锁
-	并且如果这个ThreadPool已经被关闭了，就以resultType的默认值创建一个可以被用的future
-	*/
-	std::unique_lock<std::mutex> guard(mutex_);
-	if (shutdown_) {
-		return makeReadyFuture<resultType>(resultType());
+	Promise<resultType> promise;
+	auto future = promise.getFuture();
+
+	auto func = std::bind(std::forward<F>(f), std::forward<Args>(args)...);
+	Task task = Fiber::launcher(this, [func = std::move(func), pm = std::move(promise)]() mutable {
+		pm.setWith(func);
+	});
+
+	// Like schedule(), but a pool shut down frees the fiber and says so
+	TaskOptions options;
+	options.onFull = OnFull::Spill;
+	if (_submit(std::move(task), options) == Submitted::Shutdown) {
+		return _shutdownFuture<resultType>(isVoid());
 	}
 
+	return future;
+}
+
+template<typename F, typename... Args>
+auto ThreadPool::tryExecute(F&& f, Args&& ... args) -> Future<typename std::result_of<F(Args...)>::type> {
+	TaskOptions options;
+	options.onFull = OnFull::Fail;
+	return _execute(options, std::forward<F>(f), std::forward<Args>(args)...);
+}
+
+template<typename F, typename... Args>
+auto ThreadPool::execute(const Locality& where, F&& f, Args&& ... args) -> Future<typename std::result_of<F(Args...)>::type> {
+	TaskOptions options;
+	options.where = where;
+	return _execute(options, std::forward<F>(f), std::forward<Args>(args)...);
+}
+
+template<typename F, typename... Args>
+auto ThreadPool::execute(const Tag& tag, F&& f, Args&& ... args) -> Future<typename std::result_of<F(Args...)>::type> {
+	TaskOptions options;
+	options.tag = tag.id;
+	return _execute(options, std::forward<F>(f), std::forward<Args>(args)...);
+}
+
+template<typename F, typename... Args>
+auto ThreadPool::execute(Priority priority, F&& f, Args&& ... args) -> Future<typename std::result_of<F(Args...)>::type> {
+	TaskOptions options;
+	options.priority = priority;
+	return _execute(options, std::forward<F>(f), std::forward<Args>(args)...);
+}
+
+template<typename F, typename... Args>
+auto ThreadPool::execute(const TimePoint& deadline, F&& f, Args&& ... args) -> Future<typename std::result_of<F(Args...)>::type> {
+	TaskOptions options;
+	options.deadline = deadline;
+	return _execute(options, std::forward<F>(f), std::forward<Args>(args)...);
+}
+
+template<typename F, typename... Args>
+auto ThreadPool::_execute(const TaskOptions& options, F&& f, Args&& ... args) -> Future<typename std::result_of<F(Args...)>::type> {
+	// resultType为调用F(Args...)的实际类型
+	using resultType = typename std::result_of<F(Args...)>::type;
+	using isVoid = typename std::is_void<resultType>::type;
+
 	// 创建一个新的promise并且得到他的future
 	Promise<resultType> promise;
 	auto future = promise.getFuture();
@@ -170,61 +850,167 @@ auto ThreadPool::execute(F && f, Args && ... args) -> Future<typename std::resul
 	/*
 	将args绑定到函数f上面
 	接下来创建一个新的task，它capture了之前创建的function和promise
-	在这个task中，调用t并且使用一个Try struct包裹它，接着将其设置成为promise的value
 	*/
 	auto func = std::bind(std::forward<F>(f), std::forward<Args>(args)...);
-	auto task = [t = std::move(func), pm = std::move(promise)]() mutable {
-		try {
-			pm.setValue(Try<resultType>(t()));
-		}
-		catch (...) {
-			pm.setException(std::current_exception());
+	Task task = _makeTask(std::move(promise), std::move(func));
+
+	/*
+	如果这个ThreadPool已经被关闭了，_submit会失败
+	这种情况下以resultType的默认值创建一个可以被用的future
+	*/
+	switch (_submit(std::move(task), options)) {
+	case Submitted::Queued:
+		return future;
+
+	case Submitted::Shutdown:
+		return _shutdownFuture<resultType>(isVoid());
+
+	case Submitted::Overloaded:
+		return makeExceptionFuture<resultType>(OverloadedError());
+
+	default:
+		// tryExecute fails without a future, execute with a failed one
+		if (options.onFull == OnFull::Fail) {
+			return Future<resultType>();
 		}
-	};
+		return makeExceptionFuture<resultType>(QueueFullError());
+	}
+}
 
-	tasks_.emplace_back(std::move(task));
-	if (waiters_ == 0 && currentThreads_ < maxThreads_) {
-		_spawnWorker();
+template<typename Range, typename F>
+auto ThreadPool::executeBatch(const Range& range, F&& f)
+	->std::vector<Future<typename std::result_of<F(const typename std::decay<decltype(*std::begin(range))>::type&)>::type>> {
+	using ItemType = typename std::decay<decltype(*std::begin(range))>::type;
+	using resultType = typename std::result_of<F(const ItemType&)>::type;
+	using isVoid = typename std::is_void<resultType>::type;
+
+	// Shared by all tasks, so a big f is not copied per item
+	auto func = std::make_shared<typename std::decay<F>::type>(std::forward<F>(f));
+
+	std::vector<Future<resultType>> futures;
+	std::vector<Task> tasks;
+	for (const auto& item : range) {
+		Promise<resultType> promise;
+		futures.push_back(promise.getFuture());
+		tasks.push_back(_makeTask(std::move(promise), [func, item]() {
+			return (*func)(item);
+		}));
 	}
 
-	cond_.notify_one();
+	if (tasks.empty()) {
+		return futures;
+	}
 
-	return future;
-}
+	switch (_submitBatch(std::move(tasks))) {
+	case Submitted::Queued:
+		break;
 
-// F returns void
-template<typename F, typename... Args, typename>
-auto ThreadPool::execute(F&& f, Args&& ... args) -> Future<void> {
-	using resultType = typename std::result_of<F(Args...)>::type;
-	static_assert(std::is_void<resultType>::value, "must be void");
+	case Submitted::Overloaded:
+		for (auto& future : futures) {
+			future = makeExceptionFuture<resultType>(OverloadedError());
+		}
+		break;
+
+	default:
+		for (auto& future : futures) {
+			future = _shutdownFuture<resultType>(isVoid());
+		}
+	}
 
-	std::unique_lock<std::mutex> guard(mutex_);
-	if (shutdown_) {
+	return futures;
+}
+
+template<typename Index, typename F>
+Future<void> ThreadPool::parallelFor(Index begin, Index end, Index grain, F&& f) {
+	if (!(begin < end)) {
 		return makeReadyFuture();
 	}
 
-	Promise<resultType> promise;
-	auto future = promise.getFuture();
+	if (grain <= Index(0)) {
+		const Index chunks = static_cast<Index>(std::max(1U, currentThreads_.load()) * 4);
+		grain = std::max(Index(1), static_cast<Index>((end - begin) / chunks));
+	}
 
-	auto func = std::bind(std::forward<F>(f), std::forward<Args>(args)...);
-	auto task = [t = std::move(func), pm = std::move(promise)]() mutable {
-		try {
-			t();
-			pm.setValue();
-		}
-		catch (...) {
-			pm.setException(std::current_exception());
+	// Shared by all chunks, the last finished one sets the promise
+	struct Join {
+		explicit Join(F&& func) :
+			f(std::forward<F>(func)),
+			pending(0),
+			failed(false) {
 		}
+
+		typename std::decay<F>::type f;
+		std::atomic<std::size_t> pending;
+		std::atomic<bool> failed;
+		std::exception_ptr exception;
+		Promise<void> promise;
 	};
 
-	tasks_.emplace_back(std::move(task));
-	if (waiters_ == 0 && currentThreads_ < maxThreads_) {
-		_spawnWorker();
+	auto join = std::make_shared<Join>(std::forward<F>(f));
+	auto future = join->promise.getFuture();
+
+	std::vector<Task> tasks;
+	for (Index first = begin; first < end; ) {
+		const Index last = (end - first > grain) ? static_cast<Index>(first + grain) : end;
+		tasks.push_back([join, first, last]() {
+			try {
+				for (Index i = first; i < last; ++i) {
+					join->f(i);
+				}
+			}
+			catch (...) {
+				bool expect = false;
+				if (join->failed.compare_exchange_strong(expect, true)) {
+					join->exception = std::current_exception();
+				}
+			}
+
+			if (--join->pending == 0) {
+				if (join->failed) {
+					join->promise.setException(join->exception);
+				}
+				else {
+					join->promise.setValue();
+				}
+			}
+		});
+		first = last;
 	}
 
-	cond_.notify_one();
+	join->pending = tasks.size();
+	switch (_submitBatch(std::move(tasks))) {
+	case Submitted::Queued:
+		return future;
 
-	return future;
+	case Submitted::Overloaded:
+		return makeExceptionFuture<void>(OverloadedError());
+
+	default:
+		return makeReadyFuture();
+	}
+}
+
+template<typename R, typename Func>
+Task ThreadPool::_makeTask(Promise<R>&& pm, Func&& func) {
+	// 在这个task中，调用t并且使用一个Try struct包裹它，接着将其设置成为promise的value
+	// A task cancelled while queued fails with CancelledError without calling t,
+	// it's counted only after its future has failed
+	return [t = std::forward<Func>(func), pm = std::move(pm)]() mutable {
+		pm.setWith([&t]() {
+			TaskCounter counter;
+			return t();
+		});
+	};
+}
+
+template<typename R>
+Future<R> ThreadPool::_shutdownFuture(std::false_type) {
+	return makeReadyFuture<R>(R());
+}
+
+template<typename R>
+Future<R> ThreadPool::_shutdownFuture(std::true_type) {
+	return makeReadyFuture();
 }
 
 } // namespace Quokka
@@ -35,48 +35,6 @@ void TimerManager::update() {
 	}
 }
 
-template<int RepeatCount, typename Duration, typename F, typename... Args>
-TimerId TimerManager::scheduleAtWithRepeat(const TimePoint& triggerTime, const Duration& period, F&& f, Args&& ... args) {
-	static_assert(RepeatCount != 0, "Can not add timer with zero count");
-
-	Timer t(triggerTime);
-
-	t.interval_ = std::max(std::chrono::milliseconds(1), std::chrono::duration_cast<std::chrono::milliseconds>(period));
-	t.count_ = RepeatCount;
-
-	TimerId id = t.id();
-
-	t.setCallback(std::forward<F>(f), std::forward<Args>(args)...);
-	timers_.insert(std::make_pair(triggerTime, std::move(t)));
-
-	return id;
-}
-
-template<int RepeatCount, typename Duration, typename F, typename... Args>
-TimerId TimerManager::scheduleAfterWithRepeat(const Duration& period, F&& f, Args&& ... args) {
-	const auto now = std::chrono::steady_clock::now();
-	return scheduleAtWithRepeat<RepeatCount>(now + period,
-		period,
-		std::forward<F>(f),
-		std::forward<Args>(args)...);
-}
-
-template<typename F, typename... Args>
-TimerId TimerManager::scheduleAt(const TimePoint& triggerTime, F&& f, Args&& ... args) {
-	return scheduleAtWithRepeat(triggerTime,
-		std::chrono::milliseconds(0),
-		std::forward<F>(f),
-		std::forward<Args>(args)...);
-}
-
-template<typename Duration, typename F, typename... Args>
-TimerId TimerManager::scheduleAfter(const Duration& duration, F&& f, Args&& ... args) {
-	const auto now = std::chrono::steady_clock::now();
-	return scheduleAt(now + duration,
-		std::forward<F>(f),
-		std::forward<Args>(args)...);
-}
-
 bool TimerManager::cancel(TimerId id) {
 	// Find in multimap(timers_) all the records whose key equals to
 	// id->first(std::chrono::steady_clock::time_point)
@@ -153,9 +111,4 @@ unsigned int TimerManager::Timer::uniqueId() const {
 	return id_->second;
 }
 
-template <typename F, typename... Args>
-void TimerManager::Timer::setCallback(F&& f, Args&& ... args) {
-	func_ = std::bind(std::forward<F>(f), std::forward<Args>(args)...);
-}
-
 }  // namespace Quokka
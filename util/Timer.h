@@ -1,10 +1,13 @@
 #pragma once
 
+#include <algorithm>
 #include <chrono>
 #include <functional>
 #include <map>
 #include <memory>
 
+#include "../future/Function.h"
+
 namespace Quokka {
 
 namespace {
@@ -97,7 +100,7 @@ private:
 
 		TimerId id_;
 
-		std::function<void()> func_;
+		Task func_;
 		std::chrono::milliseconds interval_;
 		int count_;
 	};
@@ -107,4 +110,51 @@ private:
 	static unsigned int s_timerIdGen_;
 };
 
+template<int RepeatCount, typename Duration, typename F, typename... Args>
+TimerId TimerManager::scheduleAtWithRepeat(const TimePoint& triggerTime, const Duration& period, F&& f, Args&& ... args) {
+	static_assert(RepeatCount != 0, "Can not add timer with zero count");
+
+	Timer t(triggerTime);
+
+	t.interval_ = std::max(std::chrono::milliseconds(1), std::chrono::duration_cast<std::chrono::milliseconds>(period));
+	t.count_ = RepeatCount;
+
+	TimerId id = t.id();
+
+	t.setCallback(std::forward<F>(f), std::forward<Args>(args)...);
+	timers_.insert(std::make_pair(triggerTime, std::move(t)));
+
+	return id;
+}
+
+template<int RepeatCount, typename Duration, typename F, typename... Args>
+TimerId TimerManager::scheduleAfterWithRepeat(const Duration& period, F&& f, Args&& ... args) {
+	const auto now = std::chrono::steady_clock::now();
+	return scheduleAtWithRepeat<RepeatCount>(now + period,
+		period,
+		std::forward<F>(f),
+		std::forward<Args>(args)...);
+}
+
+template<typename F, typename... Args>
+TimerId TimerManager::scheduleAt(const TimePoint& triggerTime, F&& f, Args&& ... args) {
+	return scheduleAtWithRepeat<1>(triggerTime,
+		std::chrono::milliseconds(0),
+		std::forward<F>(f),
+		std::forward<Args>(args)...);
+}
+
+template<typename Duration, typename F, typename... Args>
+TimerId TimerManager::scheduleAfter(const Duration& duration, F&& f, Args&& ... args) {
+	const auto now = std::chrono::steady_clock::now();
+	return scheduleAt(now + duration,
+		std::forward<F>(f),
+		std::forward<Args>(args)...);
+}
+
+template <typename F, typename... Args>
+void TimerManager::Timer::setCallback(F&& f, Args&& ... args) {
+	func_ = std::bind(std::forward<F>(f), std::forward<Args>(args)...);
+}
+
 }  // namespace Quokka
\ No newline at end of file